@@ -1,7 +1,140 @@
 #ifndef B_TREE__B_TREE_H_
 #define B_TREE__B_TREE_H_
 
-template<std::totally_ordered K, std::copyable V>
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+ * an aggregate is a monoid over the values of a tree:
+ * lift maps a value into the monoid, combine must be associative
+ * and identity must be its neutral element
+*/
+template<typename A, typename V>
+concept Aggregate = requires(const V &value,
+                             const typename A::value_type &aggregate) {
+    { A::identity() } -> std::convertible_to<typename A::value_type>;
+    { A::lift(value) } -> std::convertible_to<typename A::value_type>;
+    {
+    A::combine(aggregate, aggregate)
+    } -> std::convertible_to<typename A::value_type>;
+};
+
+/*
+ * an aggregate whose combine does not depend on the order of its
+ * arguments, which it declares with a constexpr bool commutative member
+*/
+template<typename A>
+concept CommutativeAggregate = requires {
+    requires A::commutative;
+};
+
+/*
+ * keys that can be put into the hash index of a tree
+*/
+template<typename K>
+concept Hashable = requires(const K &key) {
+    { std::hash<K>{}(key) } -> std::convertible_to<size_t>;
+};
+
+/*
+ * the default aggregate, nothing is cached per subtree
+*/
+struct NoAggregate {
+    struct value_type {};
+
+    static constexpr bool commutative = true;
+
+    static value_type identity() {
+        return {};
+    }
+
+    template<typename V>
+    static value_type lift(const V &) {
+        return {};
+    }
+
+    static value_type combine(value_type, value_type) {
+        return {};
+    }
+};
+
+template<typename V>
+struct SumAggregate {
+    using value_type = V;
+
+    static constexpr bool commutative = true;
+
+    static value_type identity() {
+        return V{};
+    }
+
+    static value_type lift(const V &value) {
+        return value;
+    }
+
+    static value_type combine(const value_type &a, const value_type &b) {
+        return a + b;
+    }
+};
+
+template<typename V>
+struct MinAggregate {
+    using value_type = V;
+
+    static constexpr bool commutative = true;
+
+    static value_type identity() {
+        return std::numeric_limits<V>::max();
+    }
+
+    static value_type lift(const V &value) {
+        return value;
+    }
+
+    static value_type combine(const value_type &a, const value_type &b) {
+        return std::min(a, b);
+    }
+};
+
+template<typename V>
+struct MaxAggregate {
+    using value_type = V;
+
+    static constexpr bool commutative = true;
+
+    static value_type identity() {
+        return std::numeric_limits<V>::lowest();
+    }
+
+    static value_type lift(const V &value) {
+        return value;
+    }
+
+    static value_type combine(const value_type &a, const value_type &b) {
+        return std::max(a, b);
+    }
+};
+
+/*
+ * A caches the aggregate of the values of every subtree, see reduce().
+ * Values changed through iterators are not reflected in the cached
+ * aggregates, use modify() or upsert() instead.
+*/
+template<std::totally_ordered K, std::copyable V,
+    Aggregate<V> A = NoAggregate>
 class BTree {
   public:
     struct Entry {
@@ -10,7 +143,8 @@ class BTree {
 
         Entry() = default;
 
-        Entry(K key, V value) : key(key), value(value) {}
+        Entry(K key, V value) : key(std::move(key)),
+                                value(std::move(value)) {}
 
         bool operator<(const Entry &other) const {
             if (key < other.key) {
@@ -36,11 +170,305 @@ class BTree {
         }
     };
 
+    using AggregateValue = typename A::value_type;
+
+    struct Stats {
+        // stored entries, erased ones included
+        size_t entries = 0;
+        size_t nodes = 0;
+        long height = 0;
+        // stored entries divided by the capacity of all nodes
+        double fill_factor = 0;
+        // nodes with fewer than min_degree - 1 entries, the root and the
+        // right edge that appends fill from the left are not counted
+        size_t underfull_nodes = 0;
+        // entries in the hash index, its estimated size in bytes and
+        // that size divided by the entries
+        size_t hash_index_keys = 0;
+        size_t hash_index_bytes = 0;
+        double hash_index_bytes_per_key = 0;
+        // hash index writes made to follow entries between nodes
+        size_t hash_index_updates = 0;
+    };
+
+    struct Iterator;
+
   private:
+    static constexpr bool kHasAggregate = !std::is_same_v<A, NoAggregate>;
+
     class Node;
     Node *root_;
-    const long min_degree_;
+    long min_degree_;
     size_t size_;
+    // erased entries that are still stored in the nodes
+    size_t tombstones_;
+    // cached target of the append fast path, nullptr if unknown
+    mutable Node *right_most_leaf_;
+    // entries appended to right_most_leaf_ whose count and A::combine are
+    // not yet added to the ancestors of that leaf, see settleAppends()
+    mutable size_t unsettled_appends_;
+    [[no_unique_address]] mutable AggregateValue unsettled_aggregate_;
+    // subtree sizes are maintained for rank() and select(), lazy deletion
+    // and the write buffer maintain them too, see countsSubtrees()
+    bool order_statistics_;
+    bool lazy_deletion_;
+    double max_tombstone_ratio_;
+
+    // messages an internal node holds at most before pushing them down,
+    // 0 if inserts are not buffered
+    size_t write_buffer_capacity_;
+    // inserts and removes held in node buffers, the inserts are included
+    // in size_ and the entries the removes erase are not
+    size_t buffered_;
+    // every node sums the bytes of its subtree, see setMemoryAccounting()
+    bool memory_accounting_;
+
+    // inserts and removes buffered at an internal node, see setWriteBuffer()
+    struct Buffer {
+        // in arrival order, the first sorted ones sorted by key with equal
+        // keys in arrival order, see Node::sortBuffer()
+        std::vector<Entry> messages;
+        size_t sorted;
+        // A::combine of the values of the messages
+        [[no_unique_address]] AggregateValue aggregate;
+        // keys of the removes, the first removes_sorted ones sorted; a
+        // remove is older than the buffered inserts with its key and
+        // erases the last live stored entry with it, see bufferRemove()
+        std::vector<K> removes;
+        size_t removes_sorted;
+    };
+
+    /*
+     * maps the fingerprint of every stored entry to the node holding it
+    */
+    struct HashIndex {
+        // open addressing with linear probing over a power of two number
+        // of slots, at most 3/4 of them used, nullptr marks an empty slot
+        std::vector<uint32_t> fingerprints;
+        std::vector<Node *> nodes;
+        size_t keys = 0;
+        size_t updates = 0;
+
+        static uint32_t fingerprint(const K &key) {
+            // std::hash of an integer is the integer, the multiplication
+            // spreads its low bits over the high ones used here
+            size_t hash = std::hash<K>{}(key)
+                * static_cast<size_t>(0x9E3779B97F4A7C15ull);
+            return static_cast<uint32_t>(
+                hash >> (std::numeric_limits<size_t>::digits - 32));
+        }
+
+        size_t home(uint32_t fingerprint) const {
+            return fingerprint >> (32 - std::countr_zero(nodes.size()));
+        }
+
+        /*
+         * returns a node holding an entry with the key of entry, nullptr if
+         * the key is not indexed
+        */
+        Node *find(const Entry &entry, long &ind) const {
+            if (keys == 0) {
+                return nullptr;
+            }
+
+            uint32_t print = fingerprint(entry.key);
+            size_t mask = nodes.size() - 1;
+            for (size_t i = home(print); nodes[i] != nullptr;
+                 i = (i + 1) & mask) {
+                if (fingerprints[i] == print) {
+                    ind = nodes[i]->findUpperBoundEntryIndex(entry);
+                    if (nodes[i]->isEntryPresent(entry, ind)) {
+                        return nodes[i];
+                    }
+                }
+            }
+            return nullptr;
+        }
+
+        void add(const K &key, Node *node) {
+            if ((keys + 1) * 4 > nodes.size() * 3) {
+                rehash(std::max<size_t>(16, 2 * nodes.size()));
+            }
+            place(fingerprint(key), node);
+            keys++;
+            updates++;
+        }
+
+        /*
+         * points the slot of an entry with key in from at to
+        */
+        void move(const K &key, Node *from, Node *to) {
+            if (from == to) {
+                return;
+            }
+
+            size_t i = slot(key, from);
+            if (i != nodes.size()) {
+                nodes[i] = to;
+                updates++;
+            }
+        }
+
+        /*
+         * removes the slot of an entry with key in node
+        */
+        void drop(const K &key, Node *node) {
+            size_t hole = slot(key, node);
+            if (hole == nodes.size()) {
+                return;
+            }
+
+            size_t mask = nodes.size() - 1;
+            for (size_t i = (hole + 1) & mask; nodes[i] != nullptr;
+                 i = (i + 1) & mask) {
+                // a slot may fill the hole if the hole is not before its
+                // home in its probe sequence
+                if (((i - home(fingerprints[i])) & mask)
+                    >= ((i - hole) & mask)) {
+                    fingerprints[hole] = fingerprints[i];
+                    nodes[hole] = nodes[i];
+                    hole = i;
+                }
+            }
+            nodes[hole] = nullptr;
+            keys--;
+            updates++;
+        }
+
+        /*
+         * empties the table and sizes it for keys keys
+        */
+        void reset(size_t keys) {
+            this->keys = 0;
+            size_t size = std::bit_ceil(std::max<size_t>(16, keys * 4 / 3 + 1));
+            fingerprints = std::vector<uint32_t>(size);
+            nodes = std::vector<Node *>(size);
+        }
+
+        void rehash(size_t size) {
+            // the home of a slot is read from the top bits of the
+            // fingerprint, so the table has at most 2^32 slots
+            size = std::min<size_t>(size, size_t{1} << 31 << 1);
+            std::vector<uint32_t> old_fingerprints =
+                std::exchange(fingerprints, std::vector<uint32_t>(size));
+            std::vector<Node *> old_nodes =
+                std::exchange(nodes, std::vector<Node *>(size));
+            for (size_t i = 0; i < old_nodes.size(); ++i) {
+                if (old_nodes[i] != nullptr) {
+                    place(old_fingerprints[i], old_nodes[i]);
+                }
+            }
+        }
+
+        void place(uint32_t print, Node *node) {
+            size_t mask = nodes.size() - 1;
+            size_t i = home(print);
+            while (nodes[i] != nullptr) {
+                i = (i + 1) & mask;
+            }
+            fingerprints[i] = print;
+            nodes[i] = node;
+        }
+
+        /*
+         * returns the slot of an entry with key in node, the number of
+         * slots if there is none
+        */
+        size_t slot(const K &key, Node *node) const {
+            if (keys == 0) {
+                return nodes.size();
+            }
+
+            uint32_t print = fingerprint(key);
+            size_t mask = nodes.size() - 1;
+            for (size_t i = home(print); nodes[i] != nullptr;
+                 i = (i + 1) & mask) {
+                if (fingerprints[i] == print && nodes[i] == node) {
+                    return i;
+                }
+            }
+            return nodes.size();
+        }
+
+        size_t bytes() const {
+            return fingerprints.capacity() * sizeof(uint32_t)
+                + nodes.capacity() * sizeof(Node *);
+        }
+    };
+
+    // nullptr unless the hash index is enabled, shared with all nodes
+    HashIndex *hash_index_;
+
+    // per node state of the optional features, which every node of the
+    // tree has while one of them is on and none has otherwise
+    struct Extras {
+        // number of live entries stored in the subtree, only maintained
+        // while the node is counted
+        size_t subtree_size = 0;
+        // flags of the erased entries, allocated with the first such entry
+        // of the node and nullptr before; slots past number_of_entries_
+        // are never set
+        bool *erased = nullptr;
+        // number of set flags in erased
+        long erased_count = 0;
+        // number of erased entries stored in the subtree
+        size_t subtree_erased = 0;
+        // inserts and removes waiting to be pushed into the children,
+        // nullptr while there are none; leaves never have one
+        Buffer *buffer = nullptr;
+        // inserts minus removes buffered in the subtree, only maintained
+        // while the node is counted
+        long subtree_buffered = 0;
+        // hash index of the tree, taken from the parent on creation
+        HashIndex *hash_index = nullptr;
+        // bytes allocated for the nodes of the subtree
+        size_t subtree_bytes = 0;
+    };
+
+    static constexpr size_t kCacheLine = 64;
+    static constexpr long kLineKeys =
+        sizeof(K) >= kCacheLine ? 1 : kCacheLine / sizeof(K);
+
+    // keys of a node of the flattened top levels start at a cache line
+    struct alignas(kCacheLine) KeyLine {
+        K keys[kLineKeys];
+    };
+
+    /*
+     * keys of the nodes of the top levels of the tree copied in breadth
+     * first order, so the children of an image node are adjacent and the
+     * descent through these levels follows no pointers; a level is copied
+     * only as a whole and only if it fits into max_bytes with the levels
+     * above it
+    */
+    struct TopLevels {
+        // bound on the bytes of the image, 0 turns it off
+        size_t max_bytes = 0;
+        // root the image was built for, nullptr if there is none
+        Node *root = nullptr;
+        // number of copied levels
+        long levels = 0;
+        // the lines of image node j start at line j * lines_per_node,
+        // integer keys begin with summary_lines lines holding the last key
+        // of every key line, the keys follow
+        long lines_per_node = 0;
+        long summary_lines = 0;
+        std::vector<KeyLine> lines;
+        std::vector<long> counts;
+        // image index of the first child of every image node
+        std::vector<size_t> first_child;
+        // node of every image index, the level below the image included
+        std::vector<Node *> nodes;
+
+        size_t bytes() const {
+            return lines.capacity() * sizeof(KeyLine)
+                + counts.capacity() * sizeof(long)
+                + first_child.capacity() * sizeof(size_t)
+                + nodes.capacity() * sizeof(Node *);
+        }
+    };
+
+    TopLevels top_levels_;
 
     class Node {
       private:
@@ -50,14 +478,36 @@ class BTree {
         Node *parent_;
         long number_of_entries_;
         bool is_leaf_;
+        // the tree keeps order statistics, taken from the parent on creation
+        bool counted_;
+        // the entries of this node are copied into the flattened top levels
+        bool in_image_;
+        // set on a root whose flattened top levels are out of date
+        bool image_stale_;
+        // A::combine of all values stored in the subtree, in key order,
+        // the values of buffered inserts are combined last; a small one
+        // fits into the padding after the flags
+        [[no_unique_address]] AggregateValue aggregate_;
+        // state of the optional features, nullptr while all of them are
+        // off, see BTree::needsExtras()
+        Extras *extras_;
 
         Node(long min_degree, Node *parent, bool is_leaf) : min_degree_(
             min_degree),
                                                             parent_(parent),
                                                             is_leaf_(is_leaf),
-                                                            number_of_entries_(0) {
+                                                            number_of_entries_(0),
+                                                            in_image_(false),
+                                                            image_stale_(true),
+                                                            aggregate_(A::identity()) {
             entries_ = new Entry[2 * min_degree_ - 1];
+            counted_ = parent != nullptr && parent->counted_;
+            extras_ = parent == nullptr || parent->extras_ == nullptr
+                ? nullptr : new Extras{.hash_index = parent->hashIndex()};
             children_ = new Node *[2 * min_degree_];
+            if (extras_ != nullptr) {
+                extras_->subtree_bytes = allocatedBytes();
+            }
         }
 
         ~Node() {
@@ -69,15 +519,18 @@ class BTree {
 
             delete[] entries_;
             delete[] children_;
+            freeExtras();
         }
 
         /*
-         * the node must be non-full when this function is called
+         * the node must be non-full when this function is called,
+         * returns the node the entry was inserted into and stores
+         * its position there into pos
         */
-        void insertInNonFull(Entry entry) {
+        Node *insertInNonFull(Entry &&entry, long &pos) {
             if (is_leaf_) {
-                insertInNonFullLeaf(entry);
-                return;
+                pos = insertInNonFullLeaf(std::move(entry));
+                return this;
             }
 
             long ind = number_of_entries_ - 1;
@@ -86,6 +539,10 @@ class BTree {
                 ind--;
             }
 
+            if (counted_) {
+                extras_->subtree_size++;
+            }
+
             if (children_[ind + 1]->isNodeFull()) {
                 splitChild(ind + 1);
 
@@ -94,466 +551,4595 @@ class BTree {
                 }
             }
 
-            children_[ind + 1]->insertInNonFull(entry);
+            Node *node = children_[ind + 1]->insertInNonFull(std::move(entry),
+                                                             pos);
+            refreshAggregate();
+            return node;
         }
 
-        void insertInNonFullLeaf(Entry entry) {
+        long insertInNonFullLeaf(Entry &&entry) {
             long ind = number_of_entries_ - 1;
             while (ind >= 0 && entry < entries_[ind]) {
-                entries_[ind + 1] = entries_[ind];
+                moveEntry(ind + 1, this, ind);
                 ind--;
             }
 
-            entries_[ind + 1] = entry;
+            entries_[ind + 1] = std::move(entry);
+            setErased(ind + 1, false);
             number_of_entries_ = number_of_entries_ + 1;
+            if (counted_) {
+                extras_->subtree_size++;
+            }
+            refreshAggregate();
+            markImageStale();
+            return ind + 1;
         }
 
-        [[nodiscard]] bool isNodeFull() const {
-            return this->number_of_entries_ == (2 * min_degree_ - 1);
-        }
+        struct EmplaceResult {
+            Node *node;
+            long ind;
+            bool inserted;
+            // an erased entry with this key was brought back
+            bool revived;
+        };
 
         /*
-         * the child must be full when this function is called
+         * the node must be non-full when this function is called, finds the
+         * entry with the key of probe in a single descent and inserts
+         * make_value() under that key if there is none
         */
-        void splitChild(long child_index) {
-            Node *new_child = separateNewChild(children_[child_index]);
+        template<typename MakeValue>
+        EmplaceResult findOrInsert(const Entry &probe, MakeValue &make_value) {
+            long ind = findUpperBoundEntryIndex(probe);
 
-            children_[child_index]->number_of_entries_ = min_degree_ - 1;
+            if (!isEntryPresent(probe, ind) && !is_leaf_
+                && children_[ind]->isNodeFull()) {
+                splitChild(ind);
 
-            for (long j = number_of_entries_; j >= (child_index + 1); j--) {
-                children_[j + 1] = children_[j];
+                if (entries_[ind] < probe) {
+                    ind++;
+                }
             }
 
-            children_[child_index + 1] = new_child;
+            if (isEntryPresent(probe, ind)) {
+                if (!isErased(ind)) {
+                    return {this, ind, false, false};
+                }
 
-            for (long j = number_of_entries_ - 1; j > 0 && j >= child_index;
-                 j--) {
-                entries_[j + 1] = entries_[j];
+                entries_[ind].value = make_value();
+                setErased(ind, false);
+                if (counted_) {
+                    extras_->subtree_size++;
+                }
+                extras_->subtree_erased--;
+                refreshAggregate();
+                return {this, ind, true, true};
             }
 
-            if (child_index == 0) {
-                entries_[1] = entries_[0];
+            if (is_leaf_) {
+                for (long i = number_of_entries_; i > ind; --i) {
+                    moveEntry(i, this, i - 1);
+                }
+                entries_[ind] = Entry(probe.key, make_value());
+                setErased(ind, false);
+                number_of_entries_++;
+                if (counted_) {
+                    extras_->subtree_size++;
+                }
+                refreshAggregate();
+                markImageStale();
+                return {this, ind, true, false};
             }
 
-            entries_[child_index] =
-                children_[child_index]->entries_[min_degree_ - 1];
+            EmplaceResult result = children_[ind]->findOrInsert(probe,
+                                                                make_value);
+            if (result.inserted) {
+                if (counted_) {
+                    extras_->subtree_size++;
+                }
+                if (result.revived) {
+                    extras_->subtree_erased--;
+                }
+                refreshAggregate();
+            }
+            return result;
+        }
 
-            number_of_entries_ = number_of_entries_ + 1;
+        [[nodiscard]] bool isNodeFull() const {
+            return this->number_of_entries_ == (2 * min_degree_ - 1);
         }
 
-        Node *separateNewChild(const Node *child) const {
-            Node *new_child =
-                new Node(child->min_degree_, child->parent_, child->is_leaf_);
-            new_child->number_of_entries_ = min_degree_ - 1;
+        bool isErased(long ind) const {
+            return extras_ != nullptr && extras_->erased != nullptr
+                && extras_->erased[ind];
+        }
 
-            for (long j = 0; j < min_degree_ - 1; j++) {
-                new_child->entries_[j] = child->entries_[j + min_degree_];
-            }
+        HashIndex *hashIndex() const {
+            return extras_ == nullptr ? nullptr : extras_->hash_index;
+        }
 
-            if (!new_child->is_leaf_) {
-                for (long j = 0; j < min_degree_; j++) {
-                    new_child->children_[j] = child->children_[j + min_degree_];
-                    new_child->children_[j]->parent_ = new_child;
-                }
-            }
-            return new_child;
+        Buffer *buffer() const {
+            return extras_ == nullptr ? nullptr : extras_->buffer;
+        }
+
+        long erasedCount() const {
+            return extras_ == nullptr ? 0 : extras_->erased_count;
         }
 
         /*
-         * returns the index of the first entry that is greater or equal to entry
+         * the flags are allocated when the first entry of the node is
+         * erased, the bytes are added to the node and its ancestors
         */
-        long findUpperBoundEntryIndex(Entry entry) {
-            return std::upper_bound(entries_,
-                                    entries_ + number_of_entries_,
-                                    entry,
-                                    [](const Entry &a, const Entry &b) {
-                                        return a <= b;
-                                    })
-                - entries_;
+        void setErased(long ind, bool erased) {
+            if (extras_ == nullptr || extras_->erased == nullptr) {
+                if (!erased) {
+                    return;
+                }
+                extras_->erased = new bool[2 * min_degree_ - 1]();
+                addSubtreeBytes((2 * min_degree_ - 1) * sizeof(bool));
+            }
+            extras_->erased_count +=
+                static_cast<long>(erased) - extras_->erased[ind];
+            extras_->erased[ind] = erased;
         }
 
-        bool isEntryPresent(Entry entry, long ind) const {
-            return ind < number_of_entries_ && entries_[ind] == entry;
+        /*
+         * moves the entry at from of source into the slot at to of this
+         * node together with its erased flag, the flag of the vacated
+         * slot is cleared
+        */
+        void moveEntry(long to, Node *source, long from) {
+            entries_[to] = std::move(source->entries_[from]);
+            bool erased = source->isErased(from);
+            source->setErased(from, false);
+            setErased(to, erased);
         }
 
-        void removeFromLeaf(long ind) {
-            for (long i = ind + 1; i < number_of_entries_; ++i) {
-                entries_[i - 1] = entries_[i];
+        /*
+         * returns number of entries in [from, to) that are not erased
+        */
+        long countLive(long from, long to) const {
+            long erased = erasedCount();
+            if (erased == 0) {
+                return to - from;
+            }
+            if (from == 0 && to == number_of_entries_) {
+                return to - erased;
             }
 
-            number_of_entries_--;
+            long live = 0;
+            for (long i = from; i < to; ++i) {
+                if (!isErased(i)) {
+                    live++;
+                }
+            }
+            return live;
         }
 
-        void removeFromNonLeaf(long ind) {
-            Entry entry = entries_[ind];
-
-            if (children_[ind]->number_of_entries_ >= min_degree_) {
-                Entry prev_entry = children_[ind]->getMaxEntryInSubtree();
-                entries_[ind] = prev_entry;
-                children_[ind]->remove(prev_entry);
-                return;
+        /*
+         * recomputes the cached subtree statistics from the children,
+         * which must already be up to date; only nodes whose entries or
+         * children were moved by a split, merge or borrow need this, an
+         * insert or removal just adds or subtracts one along its path
+        */
+        void refreshSummary() {
+            if (counted_) {
+                extras_->subtree_size = countLive(0, number_of_entries_);
+                extras_->subtree_buffered = bufferBalance();
             }
-
-            if (children_[ind + 1]->number_of_entries_ >= min_degree_) {
-                Entry next_entry = children_[ind + 1]->getMinEntryInSubtree();
-                entries_[ind] = next_entry;
-                children_[ind + 1]->remove(next_entry);
-                return;
+            if (extras_ != nullptr) {
+                extras_->subtree_erased = extras_->erased_count;
+                extras_->subtree_bytes = allocatedBytes();
+            }
+            if (!is_leaf_) {
+                for (long i = 0; i <= number_of_entries_; ++i) {
+                    if (counted_) {
+                        extras_->subtree_size +=
+                            children_[i]->extras_->subtree_size;
+                        extras_->subtree_buffered +=
+                            children_[i]->extras_->subtree_buffered;
+                    }
+                    if (extras_ != nullptr) {
+                        extras_->subtree_erased +=
+                            children_[i]->extras_->subtree_erased;
+                        extras_->subtree_bytes +=
+                            children_[i]->extras_->subtree_bytes;
+                    }
+                }
             }
+            refreshAggregate();
+        }
 
-            merge(ind);
-            children_[ind]->remove(entry);
+        /*
+         * recomputes aggregate_ from the entries and the children
+        */
+        void refreshAggregate() {
+            if constexpr (kHasAggregate) {
+                AggregateValue aggregate = A::identity();
+                for (long i = 0; i < number_of_entries_; ++i) {
+                    if (!is_leaf_) {
+                        aggregate =
+                            A::combine(aggregate, children_[i]->aggregate_);
+                    }
+                    if (!isErased(i)) {
+                        aggregate =
+                            A::combine(aggregate, A::lift(entries_[i].value));
+                    }
+                }
+                if (!is_leaf_) {
+                    aggregate = A::combine(aggregate,
+                                           children_[number_of_entries_]->aggregate_);
+                }
+                if (buffer() != nullptr) {
+                    aggregate = A::combine(aggregate, buffer()->aggregate);
+                }
+                aggregate_ = aggregate;
+            }
         }
 
-        Entry getMaxEntryInSubtree() {
-            Node *right_most_leaf = this->getRightMostLeaf();
-            return right_most_leaf->entries_[right_most_leaf->number_of_entries_
-                - 1];
+        /*
+         * returns number of bytes allocated for this node and its arrays
+        */
+        size_t allocatedBytes() const {
+            size_t bytes = nodeBytes();
+            if (extras_ != nullptr && extras_->erased != nullptr) {
+                bytes += (2 * min_degree_ - 1) * sizeof(bool);
+            }
+            return bytes;
         }
 
-        Entry getMinEntryInSubtree() {
-            return this->getLeftMostLeaf()->entries_[0];
+        /*
+         * same without the erased flags, which setErased() accounts for
+         * when it allocates them
+        */
+        size_t nodeBytes() const {
+            return sizeof(Node)
+                + (extras_ == nullptr ? 0 : sizeof(Extras))
+                + (2 * min_degree_ - 1) * sizeof(Entry)
+                + 2 * min_degree_ * sizeof(Node *);
         }
 
-        void fillToMinDegree(long ind) {
-            if (ind != 0
-                && children_[ind - 1]->number_of_entries_ >= min_degree_) {
-                borrowFromPrev(ind);
-                return;
+        /*
+         * returns number of bytes allocated for the nodes of the subtree
+        */
+        size_t subtreeBytes() const {
+            if (extras_ != nullptr) {
+                return extras_->subtree_bytes;
+            }
+            size_t bytes = allocatedBytes();
+            if (!is_leaf_) {
+                for (long i = 0; i <= number_of_entries_; ++i) {
+                    bytes += children_[i]->subtreeBytes();
+                }
             }
+            return bytes;
+        }
 
-            if (ind != number_of_entries_
-                && children_[ind + 1]->number_of_entries_ >= min_degree_) {
-                borrowFromNext(ind);
+        /*
+         * adds bytes of a node allocated below this one to this node and
+         * its ancestors
+        */
+        void addSubtreeBytes(size_t bytes) {
+            if (extras_ == nullptr) {
                 return;
             }
+            for (Node *node = this; node != nullptr; node = node->parent_) {
+                node->extras_->subtree_bytes += bytes;
+            }
+        }
 
-            if (ind != number_of_entries_) {
-                merge(ind);
+        /*
+         * subtracts bytes of a node freed below this one
+        */
+        void subSubtreeBytes(size_t bytes) {
+            if (extras_ == nullptr) {
                 return;
             }
-
-            merge(ind - 1);
+            for (Node *node = this; node != nullptr; node = node->parent_) {
+                node->extras_->subtree_bytes -= bytes;
+            }
         }
 
-        void borrowFromPrev(long ind) {
-            Node *child = children_[ind];
-            Node *left_sibling = children_[ind - 1];
-
-            for (long i = child->number_of_entries_ - 1; i >= 0; --i) {
-                child->entries_[i + 1] = child->entries_[i];
+        void refreshPathToRoot() {
+            for (Node *node = this; node != nullptr; node = node->parent_) {
+                node->refreshSummary();
             }
-            child->entries_[0] = entries_[ind - 1];
+        }
 
-            if (!child->is_leaf_) {
-                for (long i = child->number_of_entries_; i >= 0; --i) {
-                    child->children_[i + 1] = child->children_[i];
+        void refreshAggregatesToRoot() {
+            if constexpr (kHasAggregate) {
+                for (Node *node = this; node != nullptr; node = node->parent_) {
+                    node->refreshAggregate();
                 }
-                child->children_[0] =
-                    left_sibling->children_[left_sibling->number_of_entries_];
-                child->children_[0]->parent_ = child;
             }
+        }
 
-            entries_[ind - 1] =
-                left_sibling->entries_[left_sibling->number_of_entries_ - 1];
+        /*
+         * adds delta to the subtree sizes of this node and its ancestors
+        */
+        void addToPathSizes(long delta) {
+            if (!counted_) {
+                return;
+            }
+            for (Node *node = this; node != nullptr; node = node->parent_) {
+                node->extras_->subtree_size += delta;
+            }
+        }
 
-            child->number_of_entries_++;
-            left_sibling->number_of_entries_--;
+        /*
+         * adds delta to the erased counts of this node and its ancestors
+        */
+        void addToPathErased(long delta) {
+            for (Node *node = this; node != nullptr; node = node->parent_) {
+                node->extras_->subtree_erased += delta;
+            }
         }
 
-        void borrowFromNext(long ind) {
-            Node *child = children_[ind];
-            Node *sibling = children_[ind + 1];
+        /*
+         * adds delta to the buffered counts of this node and its ancestors
+        */
+        void addToPathBuffered(long delta) {
+            if (!counted_) {
+                return;
+            }
+            for (Node *node = this; node != nullptr; node = node->parent_) {
+                node->extras_->subtree_buffered += delta;
+            }
+        }
+
+        /*
+         * sets counted_ and gives or takes the Extras of every node of the
+         * subtree
+        */
+        void setCounted(bool counted, bool extras) {
+            counted_ = counted;
+            if (!is_leaf_) {
+                for (long i = 0; i <= number_of_entries_; ++i) {
+                    children_[i]->setCounted(counted, extras);
+                }
+            }
+            if (!extras) {
+                freeExtras();
+            } else if (extras_ == nullptr) {
+                extras_ = new Extras();
+            }
+            if (extras) {
+                refreshSummary();
+            }
+        }
+
+        void freeExtras() {
+            if (extras_ != nullptr) {
+                delete[] extras_->erased;
+                delete extras_->buffer;
+                delete extras_;
+                extras_ = nullptr;
+            }
+        }
+
+        /*
+         * sets the features of a node created without a parent
+        */
+        void equip(bool counted, bool extras) {
+            counted_ = counted;
+            if (extras && extras_ == nullptr) {
+                extras_ = new Extras();
+                extras_->subtree_bytes = allocatedBytes();
+            }
+        }
+
+        /*
+         * gives a node created without a parent the features and the hash
+         * index of node
+        */
+        void equipLike(const Node *node) {
+            equip(node->counted_, node->extras_ != nullptr);
+            if (extras_ != nullptr) {
+                extras_->hash_index = node->extras_->hash_index;
+            }
+        }
+
+        /*
+         * the child must be full when this function is called
+        */
+        void splitChild(long child_index) {
+            Node *new_child = separateNewChild(children_[child_index]);
+
+            children_[child_index]->number_of_entries_ = min_degree_ - 1;
+
+            for (long j = number_of_entries_; j >= (child_index + 1); j--) {
+                children_[j + 1] = children_[j];
+            }
+
+            children_[child_index + 1] = new_child;
+
+            for (long j = number_of_entries_ - 1; j > 0 && j >= child_index;
+                 j--) {
+                moveEntry(j + 1, this, j);
+            }
+
+            if (child_index == 0) {
+                moveEntry(1, this, 0);
+            }
+
+            moveEntry(child_index, children_[child_index], min_degree_ - 1);
+
+            number_of_entries_ = number_of_entries_ + 1;
 
-            child->entries_[(child->number_of_entries_)] = entries_[ind];
+            children_[child_index]->splitBuffer(new_child,
+                                                entries_[child_index]);
+            children_[child_index]->refreshSummary();
+            new_child->refreshSummary();
+            addSubtreeBytes(new_child->nodeBytes());
+            new_child->reindexEntries(0, new_child->number_of_entries_,
+                                      children_[child_index]);
+            reindexEntry(child_index, children_[child_index]);
+            children_[child_index]->markImageStale();
+            markImageStale();
+        }
+
+        /*
+         * splits the full last child close to its right end, so the left
+         * part stays nearly full when keys only arrive at the right edge
+        */
+        void splitLastChild() {
+            Node *child = children_[number_of_entries_];
+            long keep = child->is_leaf_ ? 2 * min_degree_ - 2
+                                        : 2 * min_degree_ - 3;
+            long moved = child->number_of_entries_ - keep - 1;
+
+            Node *new_child = new Node(min_degree_, this, child->is_leaf_);
+            for (long i = 0; i < moved; ++i) {
+                new_child->moveEntry(i, child, keep + 1 + i);
+            }
 
             if (!child->is_leaf_) {
-                child->children_[(child->number_of_entries_) + 1] =
-                    sibling->children_[0];
-                sibling->children_[0]->parent_ = child;
+                for (long i = 0; i <= moved; ++i) {
+                    new_child->children_[i] = child->children_[keep + 1 + i];
+                    new_child->children_[i]->parent_ = new_child;
+                }
             }
+            new_child->number_of_entries_ = moved;
+
+            moveEntry(number_of_entries_, child, keep);
+            child->number_of_entries_ = keep;
+            children_[number_of_entries_ + 1] = new_child;
+            number_of_entries_++;
+
+            child->splitBuffer(new_child, entries_[number_of_entries_ - 1]);
+            child->refreshSummary();
+            new_child->refreshSummary();
+            addSubtreeBytes(new_child->nodeBytes());
+            new_child->reindexEntries(0, moved, child);
+            reindexEntry(number_of_entries_ - 1, child);
+            child->markImageStale();
+            markImageStale();
+        }
 
-            entries_[ind] = sibling->entries_[0];
+        Node *separateNewChild(Node *child) const {
+            Node *new_child =
+                new Node(child->min_degree_, child->parent_, child->is_leaf_);
+            new_child->number_of_entries_ = min_degree_ - 1;
 
-            for (long i = 1; i < sibling->number_of_entries_; ++i) {
-                sibling->entries_[i - 1] = sibling->entries_[i];
+            for (long j = 0; j < min_degree_ - 1; j++) {
+                new_child->moveEntry(j, child, j + min_degree_);
             }
 
-            if (!sibling->is_leaf_) {
-                for (long i = 1; i <= sibling->number_of_entries_; ++i) {
-                    sibling->children_[i - 1] = sibling->children_[i];
+            if (!new_child->is_leaf_) {
+                for (long j = 0; j < min_degree_; j++) {
+                    new_child->children_[j] = child->children_[j + min_degree_];
+                    new_child->children_[j]->parent_ = new_child;
                 }
             }
+            return new_child;
+        }
 
-            child->number_of_entries_++;
-            sibling->number_of_entries_--;
+        /*
+         * returns the index of the first entry that is greater or equal to entry
+        */
+        long findUpperBoundEntryIndex(const Entry &entry) const {
+            return std::upper_bound(entries_,
+                                    entries_ + number_of_entries_,
+                                    entry,
+                                    [](const Entry &a, const Entry &b) {
+                                        return a <= b;
+                                    })
+                - entries_;
         }
 
         /*
-         * A method to merge children_[ind] with children_[ind+1]
-         * children_[ind+1] is freed after merging
+         * returns the index of the first entry that is greater than entry
         */
-        void merge(long ind) {
-            Node *child = children_[ind];
-            Node *sibling = children_[ind + 1];
+        long findFirstGreaterEntryIndex(const Entry &entry) const {
+            return std::upper_bound(entries_,
+                                    entries_ + number_of_entries_,
+                                    entry)
+                - entries_;
+        }
 
-            child->entries_[min_degree_ - 1] = entries_[ind];
+        long findFirstGreaterKeyIndex(const K &key) const {
+            return std::upper_bound(entries_, entries_ + number_of_entries_,
+                                    key,
+                                    [](const K &key, const Entry &entry) {
+                                        return key < entry.key;
+                                    })
+                - entries_;
+        }
 
-            for (long i = 0; i < sibling->number_of_entries_; ++i) {
-                child->entries_[i + min_degree_] = sibling->entries_[i];
+        size_t bufferSize() const {
+            return buffer() == nullptr
+                ? 0
+                : buffer()->messages.size() + buffer()->removes.size();
+        }
+
+        long bufferBalance() const {
+            if (buffer() == nullptr) {
+                return 0;
             }
+            return static_cast<long>(buffer()->messages.size())
+                - static_cast<long>(buffer()->removes.size());
+        }
 
-            if (!child->is_leaf_) {
-                for (long i = 0; i <= sibling->number_of_entries_; ++i) {
-                    child->children_[i + min_degree_] = sibling->children_[i];
-                    sibling->children_[i] = nullptr;
-                    child->children_[i + min_degree_]->parent_ = child;
-                }
+        /*
+         * returns number of bytes allocated for the buffers of the subtree
+        */
+        size_t bufferBytes() const {
+            if (is_leaf_) {
+                return 0;
             }
 
-            for (long i = ind + 1; i < number_of_entries_; ++i) {
-                entries_[i - 1] = entries_[i];
+            size_t bytes = 0;
+            if (buffer() != nullptr) {
+                bytes += sizeof(Buffer)
+                    + buffer()->messages.capacity() * sizeof(Entry)
+                    + buffer()->removes.capacity() * sizeof(K);
+            }
+            for (long i = 0; i <= number_of_entries_; ++i) {
+                bytes += children_[i]->bufferBytes();
             }
+            return bytes;
+        }
 
-            for (long i = ind + 2; i <= number_of_entries_; ++i) {
-                children_[i - 1] = children_[i];
+        /*
+         * buffers an insert for the subtree behind the buffered ones
+        */
+        void addMessage(Entry &&entry) {
+            if (buffer() == nullptr) {
+                extras_->buffer = new Buffer{{}, 0, A::identity(), {}, 0};
             }
 
-            child->number_of_entries_ += (sibling->number_of_entries_ + 1);
-            number_of_entries_--;
+            if constexpr (kHasAggregate) {
+                auto value = A::lift(entry.value);
+                buffer()->aggregate =
+                    A::combine(buffer()->aggregate, value);
+                aggregate_ = A::combine(aggregate_, value);
+            }
+            buffer()->messages.push_back(std::move(entry));
+            if (counted_) {
+                extras_->subtree_buffered++;
+            }
+        }
 
-            delete (sibling);
+        /*
+         * buffers a remove of key for the subtree
+        */
+        void addRemove(const K &key) {
+            if (buffer() == nullptr) {
+                extras_->buffer = new Buffer{{}, 0, A::identity(), {}, 0};
+            }
+
+            buffer()->removes.push_back(key);
+            if (counted_) {
+                extras_->subtree_buffered--;
+            }
         }
 
-        Node *copyNode(Node *new_parent) {
-            Node *new_node = new Node(min_degree_, new_parent, is_leaf_);
-            new_node->number_of_entries_ = number_of_entries_;
-            for (long i = 0; i < number_of_entries_; ++i) {
-                new_node->entries_[i] = entries_[i];
-                if (!is_leaf_) {
-                    new_node->children_[i] =
-                        children_[i]->copyNode(new_node);
+        /*
+         * buffers the inserts source[from, to) handed down by the parent
+        */
+        void addMessages(std::vector<Entry> &source, size_t from, size_t to) {
+            if (from == to) {
+                return;
+            }
+            if (buffer() == nullptr) {
+                extras_->buffer = new Buffer{{}, 0, A::identity(), {}, 0};
+            }
+
+            for (size_t i = from; i < to; ++i) {
+                if constexpr (kHasAggregate) {
+                    auto value = A::lift(source[i].value);
+                    buffer()->aggregate =
+                        A::combine(buffer()->aggregate, value);
+                    aggregate_ = A::combine(aggregate_, value);
                 }
+                buffer()->messages.push_back(std::move(source[i]));
             }
-            if (!is_leaf_) {
-                new_node->children_[number_of_entries_] =
-                    children_[number_of_entries_]->copyNode(new_node);
+            if (counted_) {
+                extras_->subtree_buffered += static_cast<long>(to - from);
             }
-            return new_node;
         }
 
-      public:
+        /*
+         * buffers the removes source[from, to) from the buffer of the parent
+        */
+        void addRemoves(std::vector<K> &source, size_t from, size_t to) {
+            if (from == to) {
+                return;
+            }
+            if (buffer() == nullptr) {
+                extras_->buffer = new Buffer{{}, 0, A::identity(), {}, 0};
+            }
 
-        Node(const Node &node) = delete;
+            buffer()->removes.insert(
+                buffer()->removes.end(),
+                std::make_move_iterator(source.begin() + from),
+                std::make_move_iterator(source.begin() + to));
+            if (counted_) {
+                extras_->subtree_buffered -= static_cast<long>(to - from);
+            }
+        }
 
-        void traverse(std::ostream &out) const {
-            for (long i = 0; i < number_of_entries_; i++) {
-                if (!is_leaf_) {
-                    children_[i]->traverse(out);
-                }
-                out << " (" << entries_[i].key << ", "
-                    << entries_[i].value << ")";
+        /*
+         * sorts the inserts and the removes appended since the last sort
+         * into the sorted ones
+        */
+        void sortBuffer() const {
+            if (buffer() == nullptr) {
+                return;
             }
 
-            // print the subtree rooted with last child
-            if (!is_leaf_) {
-                children_[number_of_entries_]->traverse(out);
+            auto &messages = buffer()->messages;
+            if (buffer()->sorted != messages.size()) {
+                auto middle = messages.begin() + buffer()->sorted;
+                std::stable_sort(middle, messages.end());
+                std::inplace_merge(messages.begin(), middle, messages.end());
+                buffer()->sorted = messages.size();
+            }
+
+            auto &removes = buffer()->removes;
+            if (buffer()->removes_sorted != removes.size()) {
+                auto middle = removes.begin() + buffer()->removes_sorted;
+                std::sort(middle, removes.end());
+                std::inplace_merge(removes.begin(), middle, removes.end());
+                buffer()->removes_sorted = removes.size();
             }
         }
 
         /*
-         * returns nullptr if entry is not present
+         * returns the positions [first, last) of the buffered inserts with
+         * the key of entry
         */
-        Node *search(Entry entry) {
-            long ind = findUpperBoundEntryIndex(entry);
-
-            if (isEntryPresent(entry, ind)) {
-                return this;
+        std::pair<size_t, size_t> findMessages(const Entry &entry) const {
+            if (buffer() == nullptr) {
+                return {0, 0};
             }
 
-            if (is_leaf_) {
-                return nullptr;
+            sortBuffer();
+            auto &messages = buffer()->messages;
+            auto [first, last] = std::equal_range(messages.begin(),
+                                                  messages.end(), entry);
+            return {first - messages.begin(), last - messages.begin()};
+        }
+
+        /*
+         * returns number of buffered removes with key
+        */
+        size_t countRemoves(const K &key) const {
+            if (buffer() == nullptr || buffer()->removes.empty()) {
+                return 0;
             }
 
-            return children_[ind]->search(entry);
+            sortBuffer();
+            auto &removes = buffer()->removes;
+            auto [first, last] = std::equal_range(removes.begin(),
+                                                  removes.end(), key);
+            return last - first;
         }
 
         /*
-         * returns number of elements removed (0 or 1)
+         * returns the range of buffered inserts with keys in [*lo, *hi),
+         * where a nullptr bound is open
         */
-        int remove(Entry entry) {
-            long ind = findUpperBoundEntryIndex(entry);
+        std::pair<const Entry *, const Entry *> messagesIn(const K *lo,
+                                                           const K *hi) const {
+            if (buffer() == nullptr) {
+                return {nullptr, nullptr};
+            }
 
-            if (isEntryPresent(entry, ind)) {
-                is_leaf_ ? removeFromLeaf(ind) : removeFromNonLeaf(ind);
-                return 1;
+            sortBuffer();
+            auto less = [](const Entry &message, const K &key) {
+                return message.key < key;
+            };
+            const Entry *first = buffer()->messages.data();
+            const Entry *last = first + buffer()->messages.size();
+            if (lo != nullptr) {
+                first = std::lower_bound(first, last, *lo, less);
+            }
+            if (hi != nullptr) {
+                last = std::lower_bound(first, last, *hi, less);
             }
+            return {first, last};
+        }
 
-            if (is_leaf_) {
+        /*
+         * returns the buffered inserts minus the buffered removes of this
+         * node with keys less than key
+        */
+        long bufferBalanceBelow(const K &key) const {
+            if (buffer() == nullptr) {
                 return 0;
             }
 
-            if (children_[ind]->number_of_entries_ < min_degree_) {
-                fillToMinDegree(ind);
-            }
+            auto [first, last] = messagesIn(nullptr, &key);
+            auto &removes = buffer()->removes;
+            return static_cast<long>(last - first)
+                - (std::lower_bound(removes.begin(), removes.end(), key)
+                   - removes.begin());
+        }
 
-            // this is only true if the last child was merged with the previous child
-            if (ind > number_of_entries_) {
-                return children_[ind - 1]->remove(entry);
+        /*
+         * moves the buffered inserts [first, last) of the sorted buffer to
+         * taken
+        */
+        void takeMessages(size_t first, size_t last,
+                          std::vector<Entry> &taken) {
+            auto &messages = buffer()->messages;
+            std::move(messages.begin() + first, messages.begin() + last,
+                      std::back_inserter(taken));
+            messages.erase(messages.begin() + first, messages.begin() + last);
+            buffer()->sorted = messages.size();
+            if (counted_) {
+                extras_->subtree_buffered -= static_cast<long>(last - first);
             }
+            refreshBuffer();
+            refreshAggregate();
+        }
 
-            return children_[ind]->remove(entry);
+        /*
+         * drops the buffered removes with the key of entry and returns
+         * their number
+        */
+        size_t takeRemoves(const Entry &entry) {
+            sortBuffer();
+            auto &removes = buffer()->removes;
+            auto [first, last] = std::equal_range(removes.begin(),
+                                                  removes.end(), entry.key);
+            auto count = static_cast<size_t>(last - first);
+            removes.erase(first, last);
+            buffer()->removes_sorted = removes.size();
+            if (counted_) {
+                extras_->subtree_buffered += static_cast<long>(count);
+            }
+            refreshBuffer();
+            return count;
         }
 
-        // returns -1 if this child is not present
-        long getChildIndex(Node *child) {
-            long ind = -1;
-            for (long i = 0; i < (number_of_entries_ + 1); i++) {
-                if (children_[i] == child) {
-                    ind = i;
-                    break;
+        /*
+         * recomputes the aggregate of the buffer and frees an emptied one
+        */
+        void refreshBuffer() {
+            if (buffer()->messages.empty() && buffer()->removes.empty()) {
+                delete extras_->buffer;
+                extras_->buffer = nullptr;
+                return;
+            }
+
+            if constexpr (kHasAggregate) {
+                AggregateValue aggregate = A::identity();
+                for (const Entry &message : buffer()->messages) {
+                    aggregate = A::combine(aggregate, A::lift(message.value));
                 }
+                buffer()->aggregate = aggregate;
             }
-            return ind;
         }
 
-        Node *getRightMostLeaf() {
-            Node *subtree_root = this;
-            while (!subtree_root->is_leaf_) {
-                subtree_root =
-                    subtree_root->children_[subtree_root->number_of_entries_];
+        /*
+         * moves the buffered messages that belong right of separator to
+         * right, the node split off this one
+        */
+        void splitBuffer(Node *right, const Entry &separator) {
+            if (buffer() == nullptr) {
+                return;
             }
 
-            return subtree_root;
+            sortBuffer();
+            auto &messages = buffer()->messages;
+            auto first = std::lower_bound(messages.begin(), messages.end(),
+                                          separator);
+            auto &removes = buffer()->removes;
+            auto first_remove = std::lower_bound(removes.begin(),
+                                                 removes.end(), separator.key);
+            if (first != messages.end() || first_remove != removes.end()) {
+                right->extras_->buffer = new Buffer{
+                    std::vector<Entry>(std::make_move_iterator(first),
+                                       std::make_move_iterator(messages.end())),
+                    0, A::identity(),
+                    std::vector<K>(std::make_move_iterator(first_remove),
+                                   std::make_move_iterator(removes.end())),
+                    0};
+                right->buffer()->sorted = right->buffer()->messages.size();
+                right->buffer()->removes_sorted =
+                    right->buffer()->removes.size();
+                right->refreshBuffer();
+                messages.erase(first, messages.end());
+                removes.erase(first_remove, removes.end());
+                buffer()->sorted = messages.size();
+                buffer()->removes_sorted = removes.size();
+            }
+            refreshBuffer();
         }
 
-        Node *getLeftMostLeaf() {
-            Node *subtree_root = this;
-            while (!subtree_root->is_leaf_) {
-                subtree_root = subtree_root->children_[0];
+        /*
+         * merges as many of the sorted inserts source[from, to) as fit into
+         * this leaf and returns how many were merged
+        */
+        size_t mergeMessages(std::vector<Entry> &source, size_t from,
+                             size_t to) {
+            size_t count = std::min<size_t>(
+                to - from, 2 * min_degree_ - 1 - number_of_entries_);
+            long write = number_of_entries_ + static_cast<long>(count) - 1;
+            long read = number_of_entries_ - 1;
+            for (size_t next = from + count; next > from;) {
+                if (read >= 0 && source[next - 1] < entries_[read]) {
+                    moveEntry(write--, this, read--);
+                    continue;
+                }
+
+                entries_[write] = std::move(source[--next]);
+                setErased(write, false);
+                indexEntry(write--);
             }
 
-            return subtree_root;
+            number_of_entries_ += static_cast<long>(count);
+            if (counted_) {
+                extras_->subtree_size += count;
+            }
+            refreshAggregate();
+            markImageStale();
+            return count;
+        }
+
+        /*
+         * erases the last live entry with key before position ind of this
+         * node and returns whether there was one
+        */
+        bool eraseLastLive(long ind, const K &key) {
+            Node *node = this;
+            do {
+                long prev_ind;
+                Node *prev_node = node->prev(ind, prev_ind);
+                if ((prev_node == node && prev_ind == ind)
+                    || !(prev_node->entries_[prev_ind].key == key)) {
+                    return false;
+                }
+                node = prev_node;
+                ind = prev_ind;
+            } while (node->isErased(ind));
+
+            node->setErased(ind, true);
+            node->addToPathSizes(-1);
+            node->addToPathErased(1);
+            node->refreshAggregatesToRoot();
+            return true;
+        }
+
+        /*
+         * moves the buffered removes one level down and adds the number of
+         * applied ones to erased
+        */
+        void pushRemoves(size_t &erased) {
+            auto &removes = buffer()->removes;
+            size_t from = 0;
+            while (from < removes.size()) {
+                long ind = findFirstGreaterKeyIndex(removes[from]);
+                Node *child = children_[ind];
+                size_t to = removes.size();
+                if (ind < number_of_entries_) {
+                    to = std::lower_bound(removes.begin() + from,
+                                          removes.end(), entries_[ind].key)
+                        - removes.begin();
+                }
+
+                if (!child->is_leaf_) {
+                    child->addRemoves(removes, from, to);
+                } else {
+                    for (size_t i = from; i < to; ++i) {
+                        child->eraseLastLive(
+                            child->findFirstGreaterKeyIndex(removes[i]),
+                            removes[i]);
+                    }
+                    erased += to - from;
+                }
+                from = to;
+            }
+            removes.clear();
+            buffer()->removes_sorted = 0;
+        }
+
+        /*
+         * moves the buffered messages one level down and returns whether
+         * the buffer was emptied
+        */
+        bool pushMessages(size_t &applied, size_t &erased) {
+            sortBuffer();
+            pushRemoves(erased);
+            auto &messages = buffer()->messages;
+            size_t from = 0;
+            bool emptied = true;
+            while (from < messages.size()) {
+                // equal keys go right as in insertInNonFull()
+                long ind = findFirstGreaterEntryIndex(messages[from]);
+                Node *child = children_[ind];
+                size_t to = messages.size();
+                if (ind < number_of_entries_) {
+                    to = std::lower_bound(messages.begin() + from,
+                                          messages.end(), entries_[ind])
+                        - messages.begin();
+                }
+
+                if (!child->is_leaf_) {
+                    child->addMessages(messages, from, to);
+                    from = to;
+                    continue;
+                }
+
+                if (child->isNodeFull()) {
+                    if (isNodeFull()) {
+                        emptied = false;
+                        break;
+                    }
+                    splitChild(ind);
+                    continue;
+                }
+
+                size_t merged = child->mergeMessages(messages, from, to);
+                from += merged;
+                applied += merged;
+            }
+
+            messages.erase(messages.begin(), messages.begin() + from);
+            buffer()->sorted = messages.size();
+            refreshBuffer();
+            refreshAggregate();
+            return emptied;
+        }
+
+        /*
+         * pushes the buffers of the subtree down until none holds capacity
+         * messages and returns false if this node is full and had to stop
+        */
+        bool flushBuffer(size_t capacity, size_t &applied, size_t &erased) {
+            size_t before = applied;
+            size_t erased_before = erased;
+            bool flushed = flushSubtree(capacity, applied, erased);
+            // messages that reached a leaf left the buffers of the subtree
+            if (counted_) {
+                extras_->subtree_size += applied - before;
+                extras_->subtree_buffered -=
+                    static_cast<long>(applied - before);
+                extras_->subtree_buffered +=
+                    static_cast<long>(erased - erased_before);
+            }
+            return flushed;
+        }
+
+        /*
+         * flushBuffer() without the count updates of this node
+        */
+        bool flushSubtree(size_t capacity, size_t &applied, size_t &erased) {
+            if (bufferSize() != 0 && bufferSize() >= capacity
+                && !pushMessages(applied, erased)) {
+                return false;
+            }
+
+            for (long i = 0; i <= number_of_entries_; ++i) {
+                Node *child = children_[i];
+                if (child->is_leaf_
+                    || (capacity != 0 && child->bufferSize() < capacity)) {
+                    continue;
+                }
+
+                while (!children_[i]->flushBuffer(capacity, applied,
+                                                  erased)) {
+                    if (isNodeFull()) {
+                        return false;
+                    }
+                    splitChild(i);
+                }
+            }
+            return true;
+        }
+
+        /*
+         * called when the keys of this node change, flags the root if the
+         * node is part of the flattened top levels, the nodes on the way
+         * are flagged too in case one of them becomes the root later
+        */
+        void markImageStale() {
+            if (!in_image_) {
+                return;
+            }
+
+            for (Node *node = this; node != nullptr; node = node->parent_) {
+                node->image_stale_ = true;
+            }
+        }
+
+        /*
+         * adds the new entries in [from, to) to the hash index
+        */
+        void indexEntries(long from, long to) {
+            if constexpr (Hashable<K>) {
+                if (hashIndex() == nullptr) {
+                    return;
+                }
+                for (long i = from; i < to; ++i) {
+                    hashIndex()->add(entries_[i].key, this);
+                }
+            }
+        }
+
+        void indexEntry(long ind) {
+            indexEntries(ind, ind + 1);
+        }
+
+        /*
+         * points the hash index at this node for the entries in [from, to)
+         * moved here from source
+        */
+        void reindexEntries(long from, long to, Node *source) {
+            if constexpr (Hashable<K>) {
+                if (hashIndex() == nullptr) {
+                    return;
+                }
+                for (long i = from; i < to; ++i) {
+                    hashIndex()->move(entries_[i].key, source, this);
+                }
+            }
+        }
+
+        void reindexEntry(long ind, Node *source) {
+            reindexEntries(ind, ind + 1, source);
+        }
+
+        /*
+         * drops the entry at ind from the hash index before it leaves
+         * this node
+        */
+        void unindexEntry(long ind) {
+            if constexpr (Hashable<K>) {
+                if (hashIndex() != nullptr) {
+                    hashIndex()->drop(entries_[ind].key, this);
+                }
+            }
+        }
+
+        /*
+         * drops the entries of the subtree from the hash index
+        */
+        void unindexSubtree() {
+            for (long i = 0; i < number_of_entries_; ++i) {
+                unindexEntry(i);
+            }
+            if (!is_leaf_) {
+                for (long i = 0; i <= number_of_entries_; ++i) {
+                    children_[i]->unindexSubtree();
+                }
+            }
+        }
+
+        void attachHashIndex(HashIndex *hash_index) {
+            if (extras_ != nullptr) {
+                extras_->hash_index = hash_index;
+            }
+            indexEntries(0, number_of_entries_);
+            if (!is_leaf_) {
+                for (long i = 0; i <= number_of_entries_; ++i) {
+                    children_[i]->attachHashIndex(hash_index);
+                }
+            }
+        }
+
+        bool isEntryPresent(const Entry &entry, long ind) const {
+            return ind < number_of_entries_ && entries_[ind] == entry;
+        }
+
+        void removeFromLeaf(long ind) {
+            setErased(ind, false);
+            for (long i = ind + 1; i < number_of_entries_; ++i) {
+                moveEntry(i - 1, this, i);
+            }
+
+            number_of_entries_--;
+            markImageStale();
+        }
+
+        void removeFromNonLeaf(long ind) {
+            markImageStale();
+
+            // the moved entry is removed by position, an equal key could
+            // match another copy
+            if (children_[ind]->number_of_entries_ >= min_degree_) {
+                unindexEntry(ind);
+                entries_[ind] = children_[ind]->removeMax();
+                setErased(ind, false);
+                indexEntry(ind);
+                return;
+            }
+
+            if (children_[ind + 1]->number_of_entries_ >= min_degree_) {
+                unindexEntry(ind);
+                entries_[ind] = children_[ind + 1]->removeMin();
+                setErased(ind, false);
+                indexEntry(ind);
+                return;
+            }
+
+            long separator = children_[ind]->number_of_entries_;
+            merge(ind);
+            children_[ind]->removeAt(separator);
+        }
+
+        /*
+         * removes the entry at ind of this node
+        */
+        void removeAt(long ind) {
+            if (is_leaf_) {
+                unindexEntry(ind);
+                removeFromLeaf(ind);
+            } else {
+                removeFromNonLeaf(ind);
+            }
+            if (counted_) {
+                extras_->subtree_size--;
+            }
+            refreshAggregate();
+        }
+
+        Entry getMaxEntryInSubtree() {
+            Node *right_most_leaf = this->getRightMostLeaf();
+            return right_most_leaf->entries_[right_most_leaf->number_of_entries_
+                - 1];
+        }
+
+        Entry getMinEntryInSubtree() {
+            return this->getLeftMostLeaf()->entries_[0];
+        }
+
+        void fillToMinDegree(long ind) {
+            if (ind != 0
+                && children_[ind - 1]->number_of_entries_ >= min_degree_) {
+                borrowFromPrev(ind);
+                return;
+            }
+
+            if (ind != number_of_entries_
+                && children_[ind + 1]->number_of_entries_ >= min_degree_) {
+                borrowFromNext(ind);
+                return;
+            }
+
+            if (ind != number_of_entries_) {
+                merge(ind);
+                return;
+            }
+
+            merge(ind - 1);
+        }
+
+        void borrowFromPrev(long ind) {
+            Node *child = children_[ind];
+            Node *left_sibling = children_[ind - 1];
+
+            for (long i = child->number_of_entries_ - 1; i >= 0; --i) {
+                child->moveEntry(i + 1, child, i);
+            }
+            child->moveEntry(0, this, ind - 1);
+
+            if (!child->is_leaf_) {
+                for (long i = child->number_of_entries_; i >= 0; --i) {
+                    child->children_[i + 1] = child->children_[i];
+                }
+                child->children_[0] =
+                    left_sibling->children_[left_sibling->number_of_entries_];
+                child->children_[0]->parent_ = child;
+            }
+
+            moveEntry(ind - 1, left_sibling,
+                      left_sibling->number_of_entries_ - 1);
+
+            child->number_of_entries_++;
+            left_sibling->number_of_entries_--;
+
+            child->refreshSummary();
+            left_sibling->refreshSummary();
+            child->reindexEntry(0, this);
+            reindexEntry(ind - 1, left_sibling);
+            child->markImageStale();
+            left_sibling->markImageStale();
+            markImageStale();
+        }
+
+        void borrowFromNext(long ind) {
+            Node *child = children_[ind];
+            Node *sibling = children_[ind + 1];
+
+            child->moveEntry(child->number_of_entries_, this, ind);
+
+            if (!child->is_leaf_) {
+                child->children_[(child->number_of_entries_) + 1] =
+                    sibling->children_[0];
+                sibling->children_[0]->parent_ = child;
+            }
+
+            moveEntry(ind, sibling, 0);
+
+            for (long i = 1; i < sibling->number_of_entries_; ++i) {
+                sibling->moveEntry(i - 1, sibling, i);
+            }
+
+            if (!sibling->is_leaf_) {
+                for (long i = 1; i <= sibling->number_of_entries_; ++i) {
+                    sibling->children_[i - 1] = sibling->children_[i];
+                }
+            }
+
+            child->number_of_entries_++;
+            sibling->number_of_entries_--;
+
+            child->refreshSummary();
+            sibling->refreshSummary();
+            child->reindexEntry(child->number_of_entries_ - 1, this);
+            reindexEntry(ind, sibling);
+            child->markImageStale();
+            sibling->markImageStale();
+            markImageStale();
+        }
+
+        /*
+         * A method to merge children_[ind] with children_[ind+1]
+         * children_[ind+1] is freed after merging,
+         * the children may be underfull but must fit into one node
+        */
+        void merge(long ind) {
+            Node *child = children_[ind];
+            Node *sibling = children_[ind + 1];
+            long offset = child->number_of_entries_ + 1;
+
+            child->moveEntry(offset - 1, this, ind);
+
+            for (long i = 0; i < sibling->number_of_entries_; ++i) {
+                child->moveEntry(i + offset, sibling, i);
+            }
+
+            if (!child->is_leaf_) {
+                for (long i = 0; i <= sibling->number_of_entries_; ++i) {
+                    child->children_[i + offset] = sibling->children_[i];
+                    sibling->children_[i] = nullptr;
+                    child->children_[i + offset]->parent_ = child;
+                }
+            }
+
+            for (long i = ind + 1; i < number_of_entries_; ++i) {
+                moveEntry(i - 1, this, i);
+            }
+
+            for (long i = ind + 2; i <= number_of_entries_; ++i) {
+                children_[i - 1] = children_[i];
+            }
+
+            child->number_of_entries_ += (sibling->number_of_entries_ + 1);
+            number_of_entries_--;
+            child->refreshSummary();
+            child->reindexEntry(offset - 1, this);
+            child->reindexEntries(offset, child->number_of_entries_, sibling);
+            child->markImageStale();
+            markImageStale();
+
+            subSubtreeBytes(sibling->allocatedBytes());
+            delete (sibling);
+        }
+
+        Node *copyNode(Node *new_parent) {
+            Node *new_node = new Node(min_degree_, new_parent, is_leaf_);
+            new_node->number_of_entries_ = number_of_entries_;
+            new_node->equip(counted_, extras_ != nullptr);
+            if (extras_ != nullptr) {
+                *new_node->extras_ = *extras_;
+                new_node->extras_->hash_index = new_parent == nullptr
+                    ? nullptr : new_parent->hashIndex();
+                if (extras_->erased != nullptr) {
+                    new_node->extras_->erased = new bool[2 * min_degree_ - 1];
+                    std::copy(extras_->erased,
+                              extras_->erased + 2 * min_degree_ - 1,
+                              new_node->extras_->erased);
+                }
+                if (extras_->buffer != nullptr) {
+                    new_node->extras_->buffer = new Buffer(*extras_->buffer);
+                }
+            }
+            new_node->aggregate_ = aggregate_;
+            for (long i = 0; i < number_of_entries_; ++i) {
+                new_node->entries_[i] = entries_[i];
+                if (!is_leaf_) {
+                    new_node->children_[i] =
+                        children_[i]->copyNode(new_node);
+                }
+            }
+            if (!is_leaf_) {
+                new_node->children_[number_of_entries_] =
+                    children_[number_of_entries_]->copyNode(new_node);
+            }
+            return new_node;
+        }
+
+      public:
+
+        Node(const Node &node) = delete;
+
+        void traverse(std::ostream &out) const {
+            for (long i = 0; i < number_of_entries_; i++) {
+                if (!is_leaf_) {
+                    children_[i]->traverse(out);
+                }
+                if (!isErased(i)) {
+                    out << " (" << entries_[i].key << ", "
+                        << entries_[i].value << ")";
+                }
+            }
+
+            // print the subtree rooted with last child
+            if (!is_leaf_) {
+                children_[number_of_entries_]->traverse(out);
+            }
+        }
+
+        /*
+         * returns nullptr if entry is not present
+        */
+        Node *search(const Entry &entry) {
+            long ind = findUpperBoundEntryIndex(entry);
+
+            if (isEntryPresent(entry, ind)) {
+                return this;
+            }
+
+            if (is_leaf_) {
+                return nullptr;
+            }
+
+            return children_[ind]->search(entry);
+        }
+
+        /*
+         * returns number of elements removed (0 or 1),
+         * the removed entry is copied to removed if it is not nullptr
+        */
+        int remove(const Entry &entry, Entry *removed = nullptr) {
+            long ind = findUpperBoundEntryIndex(entry);
+
+            if (isEntryPresent(entry, ind)) {
+                if (removed != nullptr) {
+                    *removed = entries_[ind];
+                }
+                removeAt(ind);
+                return 1;
+            }
+
+            if (is_leaf_) {
+                return 0;
+            }
+
+            if (children_[ind]->number_of_entries_ < min_degree_) {
+                fillToMinDegree(ind);
+            }
+
+            // this is only true if the last child was merged with the previous child
+            if (ind > number_of_entries_) {
+                ind--;
+            }
+
+            int number_of_removed_elems = children_[ind]->remove(entry,
+                                                                 removed);
+            if (counted_) {
+                extras_->subtree_size -= number_of_removed_elems;
+            }
+            refreshAggregate();
+            return number_of_removed_elems;
+        }
+
+        /*
+         * returns number of entries in the subtree that are less than entry
+        */
+        size_t rank(const Entry &entry) {
+            long ind = findUpperBoundEntryIndex(entry);
+            size_t less = countLive(0, ind);
+
+            if (is_leaf_) {
+                return less;
+            }
+
+            long buffered = bufferBalanceBelow(entry.key);
+            for (long i = 0; i < ind; ++i) {
+                less += children_[i]->extras_->subtree_size;
+                buffered += children_[i]->extras_->subtree_buffered;
+            }
+            // a buffered remove erases a stored entry with its key, which
+            // is counted here too
+            less += static_cast<size_t>(buffered);
+            return less + children_[ind]->rank(entry);
+        }
+
+        /*
+         * returns the node holding the entry with in-order index "index" in
+         * this subtree and stores its position in the node into ind
+        */
+        Node *select(size_t index, long &ind) {
+            for (long i = 0; i < number_of_entries_; ++i) {
+                if (!is_leaf_) {
+                    if (index < children_[i]->extras_->subtree_size) {
+                        return children_[i]->select(index, ind);
+                    }
+                    index -= children_[i]->extras_->subtree_size;
+                }
+
+                if (isErased(i)) {
+                    continue;
+                }
+
+                if (index == 0) {
+                    ind = i;
+                    return this;
+                }
+                index--;
+            }
+
+            return children_[number_of_entries_]->select(index, ind);
+        }
+
+        /*
+         * returns in-order index of entries_[ind] in the whole tree,
+         * ind == number_of_entries_ of the right most leaf gives the size;
+         * without order statistics the live entries before it are counted
+         * one by one
+        */
+        size_t position(long ind) {
+            if (!counted_) {
+                size_t pos = 0;
+                Node *node = this;
+                while (true) {
+                    long prev_ind;
+                    Node *prev_node = node->prev(ind, prev_ind);
+                    if (prev_node == node && prev_ind == ind) {
+                        return pos;
+                    }
+                    node = prev_node;
+                    ind = prev_ind;
+                    if (!node->isErased(ind)) {
+                        pos++;
+                    }
+                }
+            }
+
+            size_t pos = countLive(0, ind);
+            if (!is_leaf_) {
+                for (long i = 0; i <= ind; ++i) {
+                    pos += children_[i]->extras_->subtree_size;
+                }
+            }
+
+            Node *node = this;
+            while (node->parent_ != nullptr) {
+                Node *parent = node->parent_;
+                long child_ind = parent->getChildIndex(node);
+                pos += parent->countLive(0, child_ind);
+                for (long i = 0; i < child_ind; ++i) {
+                    pos += parent->children_[i]->extras_->subtree_size;
+                }
+                node = parent;
+            }
+            return pos;
+        }
+
+        /*
+         * returns aggregate of the entries in the subtree with key in
+         * [*lo, *hi), nullptr bound means the side is unbounded
+        */
+        AggregateValue reduce(const K *lo, const K *hi) const {
+            if (lo == nullptr && hi == nullptr) {
+                return aggregate_;
+            }
+
+            AggregateValue aggregate = A::identity();
+            for (long i = 0; i <= number_of_entries_; ++i) {
+                if (!is_leaf_) {
+                    // keys of children_[i] lie between entries i - 1 and i
+                    bool below = lo != nullptr && i < number_of_entries_
+                        && entries_[i].key < *lo;
+                    bool above = hi != nullptr && i > 0
+                        && !(entries_[i - 1].key < *hi);
+
+                    if (!below && !above) {
+                        const K *child_lo = lo;
+                        if (lo != nullptr && i > 0
+                            && !(entries_[i - 1].key < *lo)) {
+                            child_lo = nullptr;
+                        }
+
+                        const K *child_hi = hi;
+                        if (hi != nullptr && i < number_of_entries_
+                            && entries_[i].key < *hi) {
+                            child_hi = nullptr;
+                        }
+
+                        aggregate = A::combine(
+                            aggregate,
+                            children_[i]->reduce(child_lo, child_hi));
+                    }
+                }
+
+                if (i == number_of_entries_) {
+                    break;
+                }
+
+                const K &key = entries_[i].key;
+                if (!isErased(i)
+                    && (lo == nullptr || !(key < *lo))
+                    && (hi == nullptr || key < *hi)) {
+                    aggregate =
+                        A::combine(aggregate, A::lift(entries_[i].value));
+                }
+            }
+
+            auto [first, last] = messagesIn(lo, hi);
+            for (; first != last; ++first) {
+                aggregate = A::combine(aggregate, A::lift(first->value));
+            }
+            return aggregate;
+        }
+
+        /*
+         * removes and returns the last entry of the subtree
+        */
+        Entry removeMax() {
+            Entry max_entry;
+            if (is_leaf_) {
+                unindexEntry(number_of_entries_ - 1);
+                max_entry = std::move(entries_[number_of_entries_ - 1]);
+                setErased(number_of_entries_ - 1, false);
+                number_of_entries_--;
+                markImageStale();
+            } else {
+                long ind = number_of_entries_;
+                if (children_[ind]->number_of_entries_ < min_degree_) {
+                    fillToMinDegree(ind);
+                }
+                if (ind > number_of_entries_) {
+                    ind--;
+                }
+                max_entry = children_[ind]->removeMax();
+            }
+
+            if (counted_) {
+                extras_->subtree_size--;
+            }
+            refreshAggregate();
+            return max_entry;
+        }
+
+        /*
+         * removes and returns the first entry of the subtree
+        */
+        Entry removeMin() {
+            Entry min_entry;
+            if (is_leaf_) {
+                unindexEntry(0);
+                min_entry = std::move(entries_[0]);
+                removeFromLeaf(0);
+            } else {
+                if (children_[0]->number_of_entries_ < min_degree_) {
+                    fillToMinDegree(0);
+                }
+                min_entry = children_[0]->removeMin();
+            }
+
+            if (counted_) {
+                extras_->subtree_size--;
+            }
+            refreshAggregate();
+            return min_entry;
+        }
+
+        /*
+         * fills children_[ind] that may have been grafted with fewer than
+         * min_degree_ - 1 entries from its siblings
+        */
+        void fixUnderfullChild(long ind) {
+            Node *child = children_[ind];
+            while (child->number_of_entries_ < min_degree_ - 1) {
+                if (ind > 0
+                    && children_[ind - 1]->number_of_entries_ >= min_degree_) {
+                    borrowFromPrev(ind);
+                } else if (ind < number_of_entries_
+                    && children_[ind + 1]->number_of_entries_ >= min_degree_) {
+                    borrowFromNext(ind);
+                } else {
+                    merge(ind > 0 ? ind - 1 : ind);
+                    return;
+                }
+            }
+        }
+
+        Node *getRoot() {
+            Node *node = this;
+            while (node->parent_ != nullptr) {
+                node = node->parent_;
+            }
+            return node;
+        }
+
+        /*
+         * moves position (this, ind) by offset entries,
+         * positions past the last entry are clamped to the end position,
+         * without order statistics it steps over the entries one by one
+        */
+        Node *advance(long ind, std::ptrdiff_t offset, long &new_ind) {
+            if (!counted_) {
+                Node *node = this;
+                new_ind = ind;
+                for (; offset > 0 && new_ind < node->number_of_entries_;
+                     --offset) {
+                    node = node->nextLive(new_ind, new_ind);
+                }
+                for (; offset < 0; ++offset) {
+                    long prev_ind;
+                    Node *prev_node = node->prevLive(new_ind, prev_ind);
+                    if ((prev_node == node && prev_ind == new_ind)
+                        || prev_node->isErased(prev_ind)) {
+                        break;
+                    }
+                    node = prev_node;
+                    new_ind = prev_ind;
+                }
+                return node;
+            }
+
+            Node *root = getRoot();
+            auto pos = static_cast<std::ptrdiff_t>(position(ind)) + offset;
+
+            if (pos < 0) {
+                pos = 0;
+            }
+
+            if (static_cast<size_t>(pos) >= root->extras_->subtree_size) {
+                Node *right_most_leaf = root->getRightMostLeaf();
+                new_ind = right_most_leaf->number_of_entries_;
+                return right_most_leaf;
+            }
+
+            return root->select(pos, new_ind);
+        }
+
+        /*
+         * returns the position that follows (this, ind) in key order,
+         * the end position is returned unchanged
+        */
+        Node *next(long ind, long &new_ind) {
+            if (ind == number_of_entries_) {
+                new_ind = ind;
+                return this;
+            }
+
+            if (!is_leaf_) {
+                new_ind = 0;
+                return children_[ind + 1]->getLeftMostLeaf();
+            }
+
+            Node *node = this;
+            ++ind;
+            while (node->parent_ != nullptr
+                && ind == node->number_of_entries_) {
+                ind = node->parent_->getChildIndex(node);
+                node = node->parent_;
+            }
+
+            if (ind == node->number_of_entries_) {
+                new_ind = number_of_entries_;
+                return this;
+            }
+
+            new_ind = ind;
+            return node;
+        }
+
+        /*
+         * returns the position that precedes (this, ind) in key order,
+         * the first position is returned unchanged
+        */
+        Node *prev(long ind, long &new_ind) {
+            if (!is_leaf_) {
+                Node *leaf = children_[ind]->getRightMostLeaf();
+                new_ind = leaf->number_of_entries_ - 1;
+                return leaf;
+            }
+
+            if (ind > 0) {
+                new_ind = ind - 1;
+                return this;
+            }
+
+            Node *node = this;
+            while (node->parent_ != nullptr
+                && (ind = node->parent_->getChildIndex(node)) == 0) {
+                node = node->parent_;
+            }
+
+            if (ind == 0) {
+                new_ind = 0;
+                return this;
+            }
+
+            new_ind = ind - 1;
+            return node->parent_;
+        }
+
+        /*
+         * same as next but skips erased entries
+        */
+        Node *nextLive(long ind, long &new_ind) {
+            Node *node = next(ind, new_ind);
+            while (new_ind < node->number_of_entries_
+                && node->isErased(new_ind)) {
+                node = node->next(new_ind, new_ind);
+            }
+            return node;
+        }
+
+        /*
+         * same as prev but skips erased entries
+        */
+        Node *prevLive(long ind, long &new_ind) {
+            Node *node = this;
+            do {
+                Node *prev_node = node->prev(ind, new_ind);
+                if (prev_node == node && new_ind == ind) {
+                    break;
+                }
+                node = prev_node;
+                ind = new_ind;
+            } while (node->isErased(ind));
+
+            new_ind = ind;
+            return node;
+        }
+
+        /*
+         * returns the leaf gap, stored into gap, that holds the buffered
+         * inserts ordered right before position ind of this node
+        */
+        Node *gapBefore(long ind, long &gap) {
+            if (is_leaf_) {
+                gap = ind;
+                return this;
+            }
+
+            Node *leaf = children_[ind]->getRightMostLeaf();
+            gap = leaf->number_of_entries_;
+            return leaf;
+        }
+
+        /*
+         * returns the leaf gap, stored into gap, that holds the buffered
+         * inserts ordered right after position ind of this node
+        */
+        Node *gapAfter(long ind, long &gap) {
+            if (is_leaf_) {
+                gap = ind + 1;
+                return this;
+            }
+
+            gap = 0;
+            return children_[ind + 1]->getLeftMostLeaf();
+        }
+
+        /*
+         * stores into lo and hi the keys of the stored entries around gap
+         * ind of this leaf, nullptr where there is none
+        */
+        void gapBounds(long gap, const K *&lo, const K *&hi) {
+            lo = nullptr;
+            hi = nullptr;
+            long ind;
+            if (gap > 0) {
+                lo = &entries_[gap - 1].key;
+            } else if (Node *node = prev(0, ind); node != this) {
+                lo = &node->entries_[ind].key;
+            }
+
+            if (gap < number_of_entries_) {
+                hi = &entries_[gap].key;
+            } else if (Node *node = next(gap - 1, ind);
+                       ind < node->number_of_entries_) {
+                hi = &node->entries_[ind].key;
+            }
+        }
+
+        /*
+         * finds the buffered insert that follows holder's messages[at] in
+         * gap ind of this leaf and returns false if there is none
+        */
+        bool nextInGap(long gap, Node *&holder, size_t &at) {
+            const Entry *current = holder == nullptr
+                ? nullptr : holder->buffer()->messages.data() + at;
+            const K *lo = nullptr;
+            const K *hi = nullptr;
+            bool bounded = false;
+            bool deeper = true;
+            const Entry *best = nullptr;
+            Node *best_holder = nullptr;
+            for (Node *node = parent_; node != nullptr; node = node->parent_) {
+                bool is_holder = node == holder;
+                if (node->buffer() != nullptr
+                    && !node->buffer()->messages.empty()) {
+                    if (!bounded) {
+                        gapBounds(gap, lo, hi);
+                        bounded = true;
+                    }
+                    auto [first, last] = node->messagesIn(lo, hi);
+                    auto less = [](const Entry &message, const K &key) {
+                        return message.key < key;
+                    };
+                    auto greater = [](const K &key, const Entry &message) {
+                        return key < message.key;
+                    };
+                    const Entry *candidate = first;
+                    if (is_holder) {
+                        candidate = current + 1;
+                    } else if (current != nullptr && deeper) {
+                        candidate = std::upper_bound(first, last,
+                                                     current->key, greater);
+                    } else if (current != nullptr) {
+                        candidate = std::lower_bound(first, last,
+                                                     current->key, less);
+                    }
+                    if (candidate != last
+                        && (best == nullptr || candidate->key < best->key)) {
+                        best = candidate;
+                        best_holder = node;
+                    }
+                }
+                if (is_holder) {
+                    deeper = false;
+                }
+            }
+
+            if (best == nullptr) {
+                return false;
+            }
+            holder = best_holder;
+            at = best - holder->buffer()->messages.data();
+            return true;
+        }
+
+        /*
+         * same as nextInGap but finds the buffered insert that precedes
+         * holder's messages[at]
+        */
+        bool prevInGap(long gap, Node *&holder, size_t &at) {
+            const Entry *current = holder == nullptr
+                ? nullptr : holder->buffer()->messages.data() + at;
+            const K *lo = nullptr;
+            const K *hi = nullptr;
+            bool bounded = false;
+            bool deeper = true;
+            const Entry *best = nullptr;
+            Node *best_holder = nullptr;
+            for (Node *node = parent_; node != nullptr; node = node->parent_) {
+                bool is_holder = node == holder;
+                if (node->buffer() != nullptr
+                    && !node->buffer()->messages.empty()) {
+                    if (!bounded) {
+                        gapBounds(gap, lo, hi);
+                        bounded = true;
+                    }
+                    auto [first, last] = node->messagesIn(lo, hi);
+                    auto less = [](const Entry &message, const K &key) {
+                        return message.key < key;
+                    };
+                    auto greater = [](const K &key, const Entry &message) {
+                        return key < message.key;
+                    };
+                    // the candidate is the insert before end
+                    const Entry *end = last;
+                    if (is_holder) {
+                        end = current;
+                    } else if (current != nullptr && deeper) {
+                        end = std::upper_bound(first, last, current->key,
+                                               greater);
+                    } else if (current != nullptr) {
+                        end = std::lower_bound(first, last, current->key,
+                                               less);
+                    }
+                    if (end != first
+                        && (best == nullptr || !((end - 1)->key < best->key))) {
+                        best = end - 1;
+                        best_holder = node;
+                    }
+                }
+                if (is_holder) {
+                    deeper = false;
+                }
+            }
+
+            if (best == nullptr) {
+                return false;
+            }
+            holder = best_holder;
+            at = best - holder->buffer()->messages.data();
+            return true;
+        }
+
+        /*
+         * returns whether a buffered remove erases the live entry at ind
+        */
+        bool isClaimed(long ind) {
+            const K &key = entries_[ind].key;
+            // the removes of a key wait on the path of its upper bound
+            size_t removes = 0;
+            for (Node *node = getRoot(); !node->is_leaf_;
+                 node = node->children_[node->findFirstGreaterKeyIndex(key)]) {
+                removes += node->countRemoves(key);
+            }
+
+            Node *node = this;
+            for (size_t after = 0; after < removes;) {
+                node = node->next(ind, ind);
+                if (ind == node->number_of_entries_
+                    || !(node->entries_[ind].key == key)) {
+                    return true;
+                }
+                if (!node->isErased(ind)) {
+                    after++;
+                }
+            }
+            return false;
+        }
+
+        /*
+         * returns the first entry of the merged order that follows holder's
+         * messages[at] in gap ind of this leaf
+        */
+        Node *firstMerged(long gap, Node *&holder, size_t &at,
+                          long &new_ind) {
+            Node *leaf = this;
+            while (true) {
+                if (leaf->nextInGap(gap, holder, at)) {
+                    new_ind = gap;
+                    return leaf;
+                }
+                holder = nullptr;
+                at = 0;
+
+                long ind = gap;
+                Node *node = gap < leaf->number_of_entries_
+                    ? leaf : leaf->next(gap - 1, ind);
+                if (ind == node->number_of_entries_
+                    || (!node->isErased(ind) && !node->isClaimed(ind))) {
+                    new_ind = ind;
+                    return node;
+                }
+                leaf = node->gapAfter(ind, gap);
+            }
+        }
+
+        /*
+         * nextLive() over the merged order of the stored entries and the
+         * buffered inserts
+        */
+        Node *nextMerged(long ind, Node *&holder, size_t &at, long &new_ind) {
+            if (holder != nullptr) {
+                return firstMerged(ind, holder, at, new_ind);
+            }
+            if (ind == number_of_entries_) {
+                new_ind = ind;
+                return this;
+            }
+
+            long gap;
+            Node *leaf = gapAfter(ind, gap);
+            return leaf->firstMerged(gap, holder, at, new_ind);
+        }
+
+        /*
+         * same as nextMerged but moves back
+        */
+        Node *prevMerged(long ind, Node *&holder, size_t &at, long &new_ind) {
+            Node *start_holder = holder;
+            size_t start_at = at;
+            long gap = ind;
+            Node *leaf = holder != nullptr ? this : gapBefore(ind, gap);
+            while (true) {
+                if (leaf->prevInGap(gap, holder, at)) {
+                    new_ind = gap;
+                    return leaf;
+                }
+                holder = nullptr;
+                at = 0;
+
+                long prev_ind = gap - 1;
+                Node *node = leaf;
+                if (gap == 0) {
+                    node = leaf->prev(0, prev_ind);
+                    if (node == leaf) {
+                        holder = start_holder;
+                        at = start_at;
+                        new_ind = ind;
+                        return this;
+                    }
+                }
+                if (!node->isErased(prev_ind) && !node->isClaimed(prev_ind)) {
+                    new_ind = prev_ind;
+                    return node;
+                }
+                leaf = node->gapBefore(prev_ind, gap);
+            }
+        }
+
+        /*
+         * returns the buffered inserts minus the buffered removes of the
+         * subtree with keys less than key
+        */
+        long bufferedBelow(const K &key) const {
+            if (is_leaf_) {
+                return 0;
+            }
+
+            long ind = findFirstGreaterKeyIndex(key);
+            long buffered = bufferBalanceBelow(key);
+            for (long i = 0; i < ind; ++i) {
+                buffered += children_[i]->extras_->subtree_buffered;
+            }
+            return buffered + children_[ind]->bufferedBelow(key);
+        }
+
+        /*
+         * position() in the merged order, see nextMerged()
+        */
+        size_t mergedPosition(long ind, Node *holder, size_t at) {
+            if (!counted_) {
+                size_t pos = 0;
+                Node *node = this;
+                while (true) {
+                    Node *prev_holder = holder;
+                    size_t prev_at = at;
+                    long prev_ind;
+                    Node *prev_node = node->prevMerged(ind, prev_holder,
+                                                       prev_at, prev_ind);
+                    if (prev_node == node && prev_ind == ind
+                        && prev_holder == holder && prev_at == at) {
+                        return pos;
+                    }
+                    node = prev_node;
+                    ind = prev_ind;
+                    holder = prev_holder;
+                    at = prev_at;
+                    pos++;
+                }
+            }
+
+            Node *root = getRoot();
+            auto pos = static_cast<long>(position(ind));
+            if (holder == nullptr) {
+                if (ind == number_of_entries_) {
+                    return root->extras_->subtree_size
+                        + root->extras_->subtree_buffered;
+                }
+                return pos + root->bufferedBelow(entries_[ind].key);
+            }
+
+            // the inserts with the key follow its stored entries less
+            // those the removes with the key erase
+            const Entry &message = holder->buffer()->messages[at];
+            pos += root->bufferedBelow(message.key);
+            bool deeper = true;
+            for (Node *node = parent_; node != nullptr; node = node->parent_) {
+                pos -= static_cast<long>(node->countRemoves(message.key));
+                auto [first, last] = node->findMessages(message);
+                if (node == holder) {
+                    pos += static_cast<long>(at - first);
+                    deeper = false;
+                } else if (deeper) {
+                    pos += static_cast<long>(last - first);
+                }
+            }
+            return pos;
+        }
+
+        /*
+         * advance() over the merged order, see nextMerged()
+        */
+        Node *advanceMerged(long ind, Node *&holder, size_t &at,
+                            std::ptrdiff_t offset, long &new_ind) {
+            if (!counted_) {
+                Node *node = this;
+                new_ind = ind;
+                for (; offset > 0; --offset) {
+                    if (holder == nullptr
+                        && new_ind == node->number_of_entries_) {
+                        break;
+                    }
+                    node = node->nextMerged(new_ind, holder, at, new_ind);
+                }
+                for (; offset < 0; ++offset) {
+                    node = node->prevMerged(new_ind, holder, at, new_ind);
+                }
+                return node;
+            }
+
+            Node *root = getRoot();
+            auto size =
+                static_cast<std::ptrdiff_t>(root->extras_->subtree_size);
+            auto target = std::clamp<std::ptrdiff_t>(
+                static_cast<std::ptrdiff_t>(mergedPosition(ind, holder, at))
+                    + offset,
+                0, size + root->extras_->subtree_buffered);
+
+            Node *node = this;
+            new_ind = ind;
+            std::ptrdiff_t stored = std::min(target, size);
+            std::ptrdiff_t remaining = 0;
+            for (int jump = 0; jump < 4; ++jump) {
+                holder = nullptr;
+                at = 0;
+                if (stored == size) {
+                    node = root->getRightMostLeaf();
+                    new_ind = node->number_of_entries_;
+                } else {
+                    node = root->select(stored, new_ind);
+                    if (node->isClaimed(new_ind)) {
+                        node = node->nextMerged(new_ind, holder, at, new_ind);
+                    }
+                }
+
+                remaining = target - static_cast<std::ptrdiff_t>(
+                    node->mergedPosition(new_ind, holder, at));
+                if (remaining == 0) {
+                    return node;
+                }
+                stored = std::clamp<std::ptrdiff_t>(stored + remaining, 0,
+                                                    size);
+            }
+
+            for (; remaining > 0; --remaining) {
+                node = node->nextMerged(new_ind, holder, at, new_ind);
+            }
+            for (; remaining < 0; ++remaining) {
+                node = node->prevMerged(new_ind, holder, at, new_ind);
+            }
+            return node;
+        }
+
+        /*
+         * returns the position of the first entry not less than entry, or
+         * greater if strict
+        */
+        Node *lowerBound(const Entry &entry, long &ind, bool strict = false) {
+            long i = strict ? findFirstGreaterEntryIndex(entry)
+                            : findUpperBoundEntryIndex(entry);
+            if (is_leaf_) {
+                ind = i;
+                return this;
+            }
+
+            Node *node = children_[i]->lowerBound(entry, ind, strict);
+            if (ind == node->number_of_entries_ && i < number_of_entries_) {
+                ind = i;
+                return this;
+            }
+            return node;
+        }
+
+        void collectStats(Stats &stats, long depth, bool right_edge) const {
+            stats.nodes++;
+            stats.entries += number_of_entries_;
+            stats.height = std::max(stats.height, depth + 1);
+            if (!right_edge && number_of_entries_ < min_degree_ - 1) {
+                stats.underfull_nodes++;
+            }
+
+            if (!is_leaf_) {
+                for (long i = 0; i <= number_of_entries_; ++i) {
+                    children_[i]->collectStats(
+                        stats, depth + 1,
+                        right_edge && i == number_of_entries_);
+                }
+            }
+        }
+
+        void collectLive(std::vector<Entry> &entries) const {
+            for (long i = 0; i < number_of_entries_; i++) {
+                if (!is_leaf_) {
+                    children_[i]->collectLive(entries);
+                }
+                if (!isErased(i)) {
+                    entries.push_back(entries_[i]);
+                }
+            }
+
+            if (!is_leaf_) {
+                children_[number_of_entries_]->collectLive(entries);
+            }
+        }
+
+        /*
+         * appends the buffered inserts of the subtree to messages, those of
+         * the children before those of their parent, so inserts with equal
+         * keys stay from the oldest to the newest, and the buffered removes
+         * to removes
+        */
+        void collectMessages(std::vector<Entry> &messages,
+                             std::vector<K> &removes) const {
+            if (is_leaf_) {
+                return;
+            }
+
+            for (long i = 0; i <= number_of_entries_; ++i) {
+                children_[i]->collectMessages(messages, removes);
+            }
+            if (buffer() != nullptr) {
+                messages.insert(messages.end(), buffer()->messages.begin(),
+                                buffer()->messages.end());
+                removes.insert(removes.end(), buffer()->removes.begin(),
+                               buffer()->removes.end());
+            }
+        }
+
+        /*
+         * returns number of levels below this node, 0 for a leaf
+        */
+        long height() const {
+            long height = 0;
+            for (const Node *node = this; !node->is_leaf_;
+                 node = node->children_[0]) {
+                height++;
+            }
+            return height;
+        }
+
+        /*
+         * returns the lowest of this node and its ancestors whose subtree
+         * holds every key between the entry at ind and entry,
+         * ind == number_of_entries_ stands for a hint past all keys
+        */
+        Node *coveringAncestor(long ind, const Entry &entry) {
+            bool to_right = ind < number_of_entries_
+                && !(entry < entries_[ind]);
+
+            Node *node = this;
+            while (node->parent_ != nullptr) {
+                Node *parent = node->parent_;
+                long child_ind = parent->getChildIndex(node);
+
+                if (to_right && child_ind < parent->number_of_entries_
+                    && entry < parent->entries_[child_ind]) {
+                    break;
+                }
+
+                if (!to_right && child_ind > 0
+                    && parent->entries_[child_ind - 1] < entry) {
+                    break;
+                }
+                node = parent;
+            }
+            return node;
+        }
+
+        /*
+         * same as lowerBound but starts from the position (this, ind),
+         * which must not be greater than entry, the cost grows with the
+         * distance between the two
+        */
+        Node *lowerBoundFrom(long ind, const Entry &entry, long &new_ind) {
+            Node *node = coveringAncestor(ind, entry)->lowerBound(entry,
+                                                                 new_ind);
+            if (new_ind == node->number_of_entries_ && new_ind > 0) {
+                node = node->next(new_ind - 1, new_ind);
+            }
+            return node;
+        }
+
+        // returns -1 if this child is not present
+        long getChildIndex(Node *child) {
+            long ind = -1;
+            for (long i = 0; i < (number_of_entries_ + 1); i++) {
+                if (children_[i] == child) {
+                    ind = i;
+                    break;
+                }
+            }
+            return ind;
+        }
+
+        Node *getRightMostLeaf() {
+            Node *subtree_root = this;
+            while (!subtree_root->is_leaf_) {
+                subtree_root =
+                    subtree_root->children_[subtree_root->number_of_entries_];
+            }
+
+            return subtree_root;
+        }
+
+        Node *getLeftMostLeaf() {
+            Node *subtree_root = this;
+            while (!subtree_root->is_leaf_) {
+                subtree_root = subtree_root->children_[0];
+            }
+
+            return subtree_root;
+        }
+
+        friend class BTree;
+    };
+
+    /*
+     * splits a full subtree root, returns the new root above it
+    */
+    Node *splitSubtreeRoot(Node *root) const {
+        Node *new_root = new Node(min_degree_, nullptr, false);
+        new_root->equipLike(root);
+        new_root->children_[0] = root;
+        root->parent_ = new_root;
+        new_root->splitChild(0);
+        new_root->refreshSummary();
+        return new_root;
+    }
+
+    void splitRoot() {
+        root_ = splitSubtreeRoot(root_);
+    }
+
+    Node *insertIfRootIsFull(Entry &&entry, long &pos) {
+        splitRoot();
+        Node *new_root = root_;
+
+        Node *node;
+        if (entry <= new_root->entries_[0]) {
+            node = new_root->children_[0]->insertInNonFull(std::move(entry),
+                                                           pos);
+        } else {
+            node = new_root->children_[1]->insertInNonFull(std::move(entry),
+                                                           pos);
+        }
+        new_root->refreshSummary();
+        return node;
+    }
+
+    /*
+     * returns the node holding a live entry equal to entry and stores its
+     * position into ind, returns nullptr if there is no such entry
+    */
+    Node *findLive(const Entry &entry, long &ind) {
+        if (root_ == nullptr) {
+            return nullptr;
+        }
+
+        if constexpr (Hashable<K>) {
+            if (hash_index_ != nullptr) {
+                Node *node = hash_index_->find(entry, ind);
+                if (node == nullptr) {
+                    return nullptr;
+                }
+                if (!node->isErased(ind)) {
+                    return node;
+                }
+            }
+        }
+
+        if (tombstones_ == 0) {
+            Node *node = top_levels_.max_bytes > 0 ? searchTopLevels(entry)
+                                                : root_->search(entry);
+            if (node != nullptr) {
+                ind = node->findUpperBoundEntryIndex(entry);
+            }
+            return node;
+        }
+
+        Node *node = root_->lowerBound(entry, ind);
+        while (node->isEntryPresent(entry, ind)) {
+            if (!node->isErased(ind)) {
+                return node;
+            }
+            node = node->next(ind, ind);
+        }
+        return nullptr;
+    }
+
+    int removeLazily(const Entry &entry, Entry *removed) {
+        long ind;
+        Node *node = findLive(entry, ind);
+        if (node == nullptr) {
+            return 0;
+        }
+
+        if (removed != nullptr) {
+            *removed = node->entries_[ind];
+        }
+
+        node->setErased(ind, true);
+        node->addToPathSizes(-1);
+        node->addToPathErased(1);
+        node->refreshAggregatesToRoot();
+        size_--;
+        tombstones_++;
+
+        if (countsSubtrees()) {
+            compactAround(node);
+        } else {
+            compactIfSparse();
+        }
+        return 1;
+    }
+
+    bool hasTooManyErased(const Node *node) const {
+        return static_cast<double>(node->extras_->subtree_erased)
+            > max_tombstone_ratio_
+                * static_cast<double>(node->extras_->subtree_size
+                                          + node->extras_->subtree_erased);
+    }
+
+    /*
+     * rebuilds the lowest subtree on the path from node to the root whose
+     * erased entries make up more than max_tombstone_ratio_ of its stored
+     * ones; the subtree keeps its height, one whose live entries cannot
+     * fill the nodes of that height is rebuilt together with its fuller
+     * neighbour, and if the two cannot fill two subtrees the parent is
+     * taken instead; only the root is rebuilt to any height, which is the
+     * whole tree
+    */
+    void compactAround(Node *node) {
+        while (node != nullptr && !hasTooManyErased(node)) {
+            node = node->parent_;
+        }
+        if (node == nullptr) {
+            return;
+        }
+
+        while (node->parent_ != nullptr) {
+            Node *parent = node->parent_;
+            long ind = parent->getChildIndex(node);
+            long height = node->height();
+            // a non-root subtree of this height holds at least this many
+            size_t minimum = power(min_degree_, height + 1) - 1;
+            if (node->extras_->subtree_size >= minimum) {
+                rebuildChildren(parent, ind, ind, height);
+                return;
+            }
+
+            long first = ind;
+            if (ind == parent->number_of_entries_
+                || (ind > 0 && parent->children_[ind - 1]->extras_->subtree_size
+                    > parent->children_[ind + 1]->extras_->subtree_size)) {
+                first = ind - 1;
+            }
+            size_t live = parent->children_[first]->extras_->subtree_size
+                + parent->children_[first + 1]->extras_->subtree_size
+                + (parent->isErased(first) ? 0 : 1);
+            if (live >= 2 * minimum + 1) {
+                rebuildChildren(parent, first, first + 1, height);
+                return;
+            }
+            node = parent;
+        }
+        compactTombstones();
+    }
+
+    /*
+     * replaces children_[first, last] of parent and the entries between
+     * them by as many subtrees of the given height, their former height,
+     * built from their live entries, which must be enough to fill them;
+     * the buffered inserts and removes of the old subtrees go to the
+     * buffers of the new subtree roots; O(size of the subtrees) plus the path to the
+     * root, the hash index is only updated for their keys
+    */
+    void rebuildChildren(Node *parent, long first, long last, long height) {
+        std::vector<Entry> entries;
+        std::vector<Entry> messages;
+        std::vector<K> removes;
+        size_t dropped = 0;
+        for (long i = first; i <= last; ++i) {
+            Node *child = parent->children_[i];
+            child->unindexSubtree();
+            child->collectLive(entries);
+            child->collectMessages(messages, removes);
+            dropped += child->extras_->subtree_erased;
+
+            if (i == last) {
+                break;
+            }
+            parent->unindexEntry(i);
+            if (!parent->isErased(i)) {
+                entries.push_back(std::move(parent->entries_[i]));
+            } else {
+                dropped++;
+            }
+        }
+
+        auto count = static_cast<size_t>(last - first + 1);
+        size_t subtree_entries = (entries.size() - (count - 1)) / count;
+        size_t larger = (entries.size() - (count - 1)) % count;
+        size_t from = 0;
+        for (size_t j = 0; j < count; ++j) {
+            size_t to = from + subtree_entries + (j < larger ? 1 : 0);
+            std::vector<Entry> part(
+                std::make_move_iterator(entries.begin() + from),
+                std::make_move_iterator(entries.begin() + to));
+            Node *rebuilt = buildSubtree(part, height, -1, false);
+
+            long ind = first + static_cast<long>(j);
+            delete parent->children_[ind];
+            parent->children_[ind] = rebuilt;
+            rebuilt->parent_ = parent;
+            if (j + 1 < count) {
+                parent->entries_[ind] = std::move(entries[to]);
+                parent->setErased(ind, false);
+                to++;
+            }
+            from = to;
+        }
+
+        // every insert goes to the new subtree that covers its key, equal
+        // keys go right as in insertInNonFull()
+        std::vector<std::vector<Entry>> routed(count);
+        for (Entry &message : messages) {
+            long ind = parent->findFirstGreaterEntryIndex(message);
+            routed[std::clamp(ind, first, last) - first].push_back(
+                std::move(message));
+        }
+        std::vector<std::vector<K>> routed_removes(count);
+        for (K &key : removes) {
+            long ind = parent->findFirstGreaterKeyIndex(key);
+            routed_removes[std::clamp(ind, first, last) - first].push_back(
+                std::move(key));
+        }
+        for (size_t j = 0; j < count; ++j) {
+            Node *child = parent->children_[first + static_cast<long>(j)];
+            child->addMessages(routed[j], 0, routed[j].size());
+            child->addRemoves(routed_removes[j], 0, routed_removes[j].size());
+        }
+
+        tombstones_ -= dropped;
+        parent->markImageStale();
+        parent->refreshPathToRoot();
+        right_most_leaf_ = nullptr;
+        // the image may hold nodes of the old subtrees
+        top_levels_.root = nullptr;
+
+        if constexpr (Hashable<K>) {
+            if (hash_index_ != nullptr) {
+                for (long i = first; i <= last; ++i) {
+                    parent->children_[i]->attachHashIndex(hash_index_);
+                }
+                parent->indexEntries(first, last);
+            }
+        }
+    }
+
+    static size_t power(size_t base, long exponent) {
+        size_t result = 1;
+        for (long i = 0; i < exponent; ++i) {
+            if (result > std::numeric_limits<size_t>::max() / base) {
+                return std::numeric_limits<size_t>::max();
+            }
+            result *= base;
+        }
+        return result;
+    }
+
+    /*
+     * number of children for a node of the given height over units - 1
+     * consecutive entries, as close to a subtree of fanout
+     * entries_per_node + 1 as the bounds on node sizes allow
+    */
+    size_t childrenFor(size_t units, long height, long entries_per_node,
+                       bool is_root) const {
+        size_t target = power(entries_per_node + 1, height);
+        size_t max_child_units = power(2 * min_degree_, height);
+        size_t min_child_units = power(min_degree_, height);
+
+        size_t lowest = std::max<size_t>(
+            is_root ? 2 : min_degree_,
+            (units + max_child_units - 1) / max_child_units);
+        size_t highest = std::min<size_t>(2 * min_degree_,
+                                          units / min_child_units);
+
+        size_t children = (units + target / 2) / target;
+        return std::clamp(children, lowest, std::max(lowest, highest));
+    }
+
+    /*
+     * replaces the content of the tree with entries, which must be sorted;
+     * nodes get about entries_per_node entries and are allocated level by
+     * level, every node and its arrays with a separate new, so where they
+     * land is up to the allocator
+    */
+    void buildFromSorted(std::vector<Entry> &entries,
+                         long entries_per_node = -1) {
+        settleAppends();
+        delete root_;
+        root_ = nullptr;
+        right_most_leaf_ = nullptr;
+        size_ = entries.size();
+        tombstones_ = 0;
+
+        if (entries.empty()) {
+            rebuildHashIndex();
+            return;
+        }
+
+        entries_per_node = entriesPerNode(entries_per_node);
+        size_t units = entries.size() + 1;
+        long height = 0;
+        while (power(entries_per_node + 1, height + 1) < units) {
+            height++;
+        }
+        // a root with a single child is not allowed
+        while (height > 0 && units / power(min_degree_, height) < 2) {
+            height--;
+        }
+
+        root_ = buildSubtree(entries, height, entries_per_node, true);
+        rebuildHashIndex();
+    }
+
+    /*
+     * clamps the requested number of entries per built node to the bounds
+     * of a node, a negative number asks for full nodes
+    */
+    long entriesPerNode(long entries_per_node) const {
+        if (entries_per_node < 0) {
+            entries_per_node = 2 * min_degree_ - 1;
+        }
+        return std::clamp(entries_per_node, min_degree_ - 1,
+                          2 * min_degree_ - 1);
+    }
+
+    /*
+     * builds a detached subtree of the given height over entries, which
+     * must be sorted and enough to give every node of that height its
+     * minimum number of entries, the root included unless is_root;
+     * returns its root, the nodes are not in the hash index
+    */
+    Node *buildSubtree(std::vector<Entry> &entries, long height,
+                       long entries_per_node, bool is_root) {
+        entries_per_node = entriesPerNode(entries_per_node);
+
+        // nodes still to be built, parents come before their children
+        struct Pending {
+            Node *parent;
+            long child_ind;
+            size_t first;
+            size_t units;
+            long height;
+        };
+
+        Node *root = nullptr;
+        std::vector<Node *> nodes;
+        std::vector<Pending> queue{{nullptr, 0, 0, entries.size() + 1,
+                                    height}};
+        for (size_t next = 0; next < queue.size(); ++next) {
+            Pending pending = queue[next];
+            Node *node = new Node(min_degree_, pending.parent,
+                                  pending.height == 0);
+            node->equip(countsSubtrees(), needsExtras());
+            nodes.push_back(node);
+
+            if (pending.parent == nullptr) {
+                root = node;
+            } else {
+                pending.parent->children_[pending.child_ind] = node;
+            }
+
+            if (pending.height == 0) {
+                node->number_of_entries_ =
+                    static_cast<long>(pending.units - 1);
+                for (long i = 0; i < node->number_of_entries_; ++i) {
+                    node->entries_[i] = std::move(entries[pending.first + i]);
+                }
+                continue;
+            }
+
+            size_t number_of_children = childrenFor(
+                pending.units, pending.height, entries_per_node,
+                is_root && pending.parent == nullptr);
+            size_t offset = pending.first;
+            for (size_t i = 0; i < number_of_children; ++i) {
+                size_t child_units = pending.units / number_of_children
+                    + (i < pending.units % number_of_children ? 1 : 0);
+                queue.push_back({node, static_cast<long>(i), offset,
+                                 child_units, pending.height - 1});
+                offset += child_units;
+
+                if (i + 1 < number_of_children) {
+                    node->entries_[i] = std::move(entries[offset - 1]);
+                }
+            }
+            node->number_of_entries_ =
+                static_cast<long>(number_of_children - 1);
+        }
+
+        // children were queued after their parents
+        for (auto node = nodes.rbegin(); node != nodes.rend(); ++node) {
+            (*node)->refreshSummary();
+        }
+        return root;
+    }
+
+    /*
+     * returns the node the entry was inserted into and stores
+     * its position there into pos
+    */
+    Node *insertEntry(Entry &&entry, long &pos) {
+        size_++;
+
+        if (root_ == nullptr) {
+            root_ = new Node(min_degree_, nullptr, true);
+            root_->equip(countsSubtrees(), needsExtras());
+            root_->attachHashIndex(hash_index_);
+            root_->entries_[0] = std::move(entry);
+            root_->number_of_entries_ = 1;
+            root_->refreshSummary();
+            pos = 0;
+            root_->indexEntry(pos);
+            return root_;
+        }
+
+        Node *node;
+        Node *leaf = rightMostLeaf();
+        if (!(entry < leaf->entries_[leaf->number_of_entries_ - 1])) {
+            node = appendEntry(std::move(entry), pos);
+        } else {
+            settleAppends();
+            right_most_leaf_ = nullptr;
+            if (root_->isNodeFull()) {
+                node = insertIfRootIsFull(std::move(entry), pos);
+            } else {
+                node = root_->insertInNonFull(std::move(entry), pos);
+            }
+        }
+
+        node->indexEntry(pos);
+        return node;
+    }
+
+    Node *rightMostLeaf() {
+        if (right_most_leaf_ == nullptr) {
+            right_most_leaf_ = root_->getRightMostLeaf();
+        }
+        return right_most_leaf_;
+    }
+
+    /*
+     * appends an entry that is not less than any stored entry to the
+     * right-most leaf
+    */
+    Node *appendEntry(Entry &&entry, long &pos) {
+        Node *leaf = rightMostLeaf();
+
+        if (leaf->isNodeFull()) {
+            settleAppends();
+            Node *start = leaf->parent_;
+            while (start != nullptr && start->isNodeFull()) {
+                start = start->parent_;
+            }
+
+            if (start == nullptr) {
+                start = new Node(min_degree_, nullptr, false);
+                start->equipLike(root_);
+                start->children_[0] = root_;
+                root_->parent_ = start;
+                start->refreshSummary();
+                root_ = start;
+            }
+
+            while (!start->is_leaf_) {
+                Node *last_child = start->children_[start->number_of_entries_];
+                if (last_child->isNodeFull()) {
+                    start->splitLastChild();
+                }
+                start = start->children_[start->number_of_entries_];
+            }
+
+            leaf = start;
+            right_most_leaf_ = leaf;
+        }
+
+        pos = leaf->number_of_entries_;
+        leaf->entries_[pos] = std::move(entry);
+        leaf->setErased(pos, false);
+        leaf->number_of_entries_++;
+        leaf->markImageStale();
+        if (leaf->counted_) {
+            leaf->extras_->subtree_size++;
+        }
+        if constexpr (kHasAggregate) {
+            auto value = A::lift(leaf->entries_[pos].value);
+            leaf->aggregate_ = A::combine(leaf->aggregate_, value);
+            if (leaf->parent_ != nullptr) {
+                unsettled_aggregate_ =
+                    A::combine(unsettled_aggregate_, value);
+            }
+        }
+        if (leaf->parent_ != nullptr) {
+            unsettled_appends_++;
+        }
+        return leaf;
+    }
+
+    /*
+     * adds the appends not yet counted to the ancestors of the right-most
+     * leaf
+    */
+    void settleAppends() const {
+        if (unsettled_appends_ == 0) {
+            return;
+        }
+
+        for (Node *node = right_most_leaf_->parent_; node != nullptr;
+             node = node->parent_) {
+            if (node->counted_) {
+                node->extras_->subtree_size += unsettled_appends_;
+            }
+            if constexpr (kHasAggregate) {
+                node->aggregate_ =
+                    A::combine(node->aggregate_, unsettled_aggregate_);
+            }
+        }
+        unsettled_appends_ = 0;
+        unsettled_aggregate_ = A::identity();
+    }
+
+    /*
+     * inserts entry starting from the lowest ancestor of the hint node
+     * whose subtree covers both the hint and the entry,
+     * returns the node the entry was inserted into
+    */
+    Node *insertEntryNear(Node *hint_node, long hint_ind, Entry &&entry,
+                          long &pos) {
+        settleAppends();
+        right_most_leaf_ = nullptr;
+
+        Node *start = hint_node->coveringAncestor(hint_ind, entry);
+        while (start->isNodeFull() && start->parent_ != nullptr) {
+            start = start->parent_;
+        }
+
+        size_++;
+        if (start->isNodeFull()) {
+            Node *node = insertIfRootIsFull(std::move(entry), pos);
+            node->indexEntry(pos);
+            return node;
+        }
+
+        Node *node = start->insertInNonFull(std::move(entry), pos);
+        node->indexEntry(pos);
+
+        if (start->parent_ != nullptr) {
+            start->parent_->addToPathSizes(1);
+            start->parent_->refreshAggregatesToRoot();
+        }
+        return node;
+    }
+
+    int removeEntry(const Entry &entry, Entry *removed = nullptr) {
+        if (root_ == nullptr) {
+            return 0;
+        }
+        settleAppends();
+
+        // a merge or borrow would move entries past buffered inserts;
+        // buffered removes would leave the aggregates of the subtrees stale
+        if (lazy_deletion_ || write_buffer_capacity_ != 0) {
+            if constexpr (!kHasAggregate) {
+                if (write_buffer_capacity_ != 0 && !root_->is_leaf_) {
+                    return bufferRemove(entry, removed);
+                }
+            }
+            return removeLazily(entry, removed);
+        }
+
+        // the removal starts from the node holding the key or the lowest
+        // ancestor of it that can give up an entry, as insertEntryNear()
+        // starts from the lowest ancestor that can take one
+        Node *start = root_;
+        if constexpr (Hashable<K>) {
+            if (hash_index_ != nullptr) {
+                long ind;
+                start = hash_index_->find(entry, ind);
+                if (start == nullptr) {
+                    return 0;
+                }
+
+                while (start->number_of_entries_ < min_degree_
+                    && start->parent_ != nullptr) {
+                    start = start->parent_;
+                }
+            }
+        }
+
+        right_most_leaf_ = nullptr;
+        int number_of_removed_elems = start->remove(entry, removed);
+        size_ -= number_of_removed_elems;
+
+        if (start->parent_ != nullptr && number_of_removed_elems != 0) {
+            start->parent_->addToPathSizes(-1);
+            start->parent_->refreshAggregatesToRoot();
+        }
+
+        if (root_->number_of_entries_ == 0) {
+            Node *old_root = root_;
+            root_ = root_->is_leaf_ ? nullptr : root_->children_[0];
+            if (root_ != nullptr) {
+                root_->parent_ = nullptr;
+            }
+
+            for (long i = 0; i <= old_root->number_of_entries_; ++i) {
+                old_root->children_[i] = nullptr;
+            }
+            delete old_root;
+            start = root_;
+        }
+        return number_of_removed_elems;
+    }
+
+    size_t hashIndexBytes() const {
+        if constexpr (Hashable<K>) {
+            if (hash_index_ != nullptr) {
+                return hash_index_->bytes();
+            }
+        }
+        return 0;
+    }
+
+    /*
+     * hands the hash index to every node and refills it from scratch
+    */
+    void rebuildHashIndex() {
+        if constexpr (Hashable<K>) {
+            if (hash_index_ == nullptr) {
+                return;
+            }
+
+            hash_index_->reset(size_ + tombstones_);
+            if (root_ != nullptr) {
+                root_->attachHashIndex(hash_index_);
+            }
+        }
+    }
+
+    /*
+     * copies the keys of the nodes of the first levels into the flattened
+     * image, walking the tree level by level while the next level fits
+     * into the byte budget, and remembers the nodes of the level below,
+     * where the descent continues through the nodes; leaves are never
+     * copied, a search reads the leaf it ends in anyway
+    */
+    void rebuildTopLevels() {
+        long key_lines = (2 * min_degree_ - 2) / kLineKeys + 1;
+        long summary_lines =
+            std::is_integral_v<K> ? (key_lines - 1) / kLineKeys + 1 : 0;
+        long lines_per_node = summary_lines + key_lines;
+        size_t node_bytes = lines_per_node * sizeof(KeyLine)
+            + sizeof(long) + sizeof(size_t) + sizeof(Node *);
+
+        std::vector<Node *> nodes{root_};
+        size_t level_begin = 0;
+        size_t bytes = sizeof(Node *);
+        long levels = 0;
+        while (!nodes[level_begin]->is_leaf_) {
+            size_t level_end = nodes.size();
+            size_t level_bytes = (level_end - level_begin) * node_bytes;
+            for (size_t j = level_begin; j < level_end; ++j) {
+                level_bytes +=
+                    (nodes[j]->number_of_entries_ + 1) * sizeof(Node *);
+            }
+            if (bytes + level_bytes > top_levels_.max_bytes) {
+                break;
+            }
+
+            bytes += level_bytes;
+            levels++;
+            for (size_t j = level_begin; j < level_end; ++j) {
+                for (long i = 0; i <= nodes[j]->number_of_entries_; ++i) {
+                    nodes.push_back(nodes[j]->children_[i]);
+                }
+            }
+            level_begin = level_end;
+        }
+
+        TopLevels &image = top_levels_;
+        image.levels = levels;
+        image.lines_per_node = lines_per_node;
+        image.summary_lines = summary_lines;
+        // integer keys are padded with the largest key, so every line can
+        // be counted whole, see searchTopLevels()
+        KeyLine padding{};
+        if constexpr (std::is_integral_v<K>) {
+            std::fill(padding.keys, padding.keys + kLineKeys,
+                      std::numeric_limits<K>::max());
+        }
+        image.lines.assign(level_begin * lines_per_node, padding);
+        image.counts.assign(level_begin, 0);
+        image.first_child.assign(level_begin, 0);
+        size_t next_child = 1;
+        for (size_t j = 0; j < level_begin; ++j) {
+            Node *node = nodes[j];
+            node->in_image_ = true;
+            KeyLine *summary = image.lines.data() + j * lines_per_node;
+            KeyLine *lines = summary + summary_lines;
+            for (long i = 0; i < node->number_of_entries_; ++i) {
+                lines[i / kLineKeys].keys[i % kLineKeys] =
+                    node->entries_[i].key;
+            }
+            for (long line = 0; line < summary_lines * kLineKeys
+                 && line < key_lines; ++line) {
+                summary[line / kLineKeys].keys[line % kLineKeys] =
+                    lines[line].keys[kLineKeys - 1];
+            }
+            image.counts[j] = node->number_of_entries_;
+            image.first_child[j] = next_child;
+            next_child += node->number_of_entries_ + 1;
+        }
+        for (size_t j = level_begin; j < nodes.size(); ++j) {
+            nodes[j]->in_image_ = false;
+        }
+        image.nodes = std::move(nodes);
+        image.nodes.shrink_to_fit();
+        image.root = root_;
+        root_->image_stale_ = false;
+    }
+
+    /*
+     * returns number of the count keys less than key, integer keys are
+     * compared without branches so the loop over a line vectorizes
+    */
+    static long countLess(const K *keys, long count, const K &key) {
+        if constexpr (std::is_integral_v<K>) {
+            long less = 0;
+            for (long i = 0; i < count; ++i) {
+                less += keys[i] < key;
+            }
+            return less;
+        } else {
+            return std::lower_bound(keys, keys + count, key) - keys;
+        }
+    }
+
+    /*
+     * Node::search() that resolves the first levels in the flattened
+     * image one cache line of keys at a time, rebuilding the image first
+     * if the root changed or flagged it; for integer keys the summary
+     * lines give the line of the key and only that line is counted, both
+     * counts take whole padded lines, so two lines are read per node and
+     * no branch depends on the keys
+    */
+    Node *searchTopLevels(const Entry &entry) {
+        if (top_levels_.root != root_ || root_->image_stale_) {
+            rebuildTopLevels();
+        }
+
+        const TopLevels &image = top_levels_;
+        size_t node = 0;
+        for (long level = 0; level < image.levels; ++level) {
+            const KeyLine *summary =
+                image.lines.data() + node * image.lines_per_node;
+            const KeyLine *lines = summary + image.summary_lines;
+            long count = image.counts[node];
+            long ind = 0;
+            if constexpr (std::is_integral_v<K>) {
+                // lines whose last key is less hold only less keys, a key
+                // above all of them is counted in the last line
+                long full = 0;
+                for (long line = 0; line < image.summary_lines; ++line) {
+                    full += countLess(summary[line].keys, kLineKeys,
+                                      entry.key);
+                }
+                long line = std::min(full, image.lines_per_node
+                                         - image.summary_lines - 1);
+                ind = line * kLineKeys
+                    + countLess(lines[line].keys, kLineKeys, entry.key);
+            } else {
+                for (long first = 0; first < count; first += kLineKeys) {
+                    ind += countLess(lines[first / kLineKeys].keys,
+                                     std::min(kLineKeys, count - first),
+                                     entry.key);
+                }
+            }
+
+            if (ind < count
+                && lines[ind / kLineKeys].keys[ind % kLineKeys]
+                    == entry.key) {
+                return image.nodes[node];
+            }
+            node = image.first_child[node] + ind;
+        }
+        return image.nodes[node]->search(entry);
+    }
+
+    /*
+     * returns number of live entries equal to entry
+    */
+    size_t countLive(const Entry &entry) {
+        if (root_ == nullptr) {
+            return 0;
+        }
+
+        long ind;
+        Node *node = root_->lowerBound(entry, ind);
+        size_t count = 0;
+        while (node->isEntryPresent(entry, ind)) {
+            if (!node->isErased(ind)) {
+                count++;
+            }
+            node = node->next(ind, ind);
+        }
+        return count;
+    }
+
+    /*
+     * flushes the node buffers down from the root, see Node::flushBuffer()
+    */
+    void flushBuffers(size_t capacity) {
+        settleAppends();
+        right_most_leaf_ = nullptr;
+
+        size_t applied = 0;
+        size_t erased = 0;
+        while (!root_->flushBuffer(capacity, applied, erased)) {
+            splitRoot();
+        }
+        buffered_ -= applied + erased;
+        tombstones_ += erased;
+    }
+
+    /*
+     * flushes the root buffer once it holds capacity messages
+    */
+    void flushFullRoot() {
+        if (root_->bufferSize() < write_buffer_capacity_) {
+            return;
+        }
+
+        flushBuffers(write_buffer_capacity_);
+        compactIfSparse();
+    }
+
+    /*
+     * drops the erased entries once they make up more than
+     * max_tombstone_ratio_ of the stored ones
+    */
+    void compactIfSparse() {
+        if (static_cast<double>(tombstones_) > max_tombstone_ratio_
+                * static_cast<double>(size_ + tombstones_)) {
+            compactTombstones();
+        }
+    }
+
+    /*
+     * returns number of buffered removes with the key of entry
+    */
+    size_t countBufferedRemoves(const Entry &entry) const {
+        size_t count = 0;
+        for (Node *node = root_; node != nullptr && !node->is_leaf_;
+             node = node->children_[node->findFirstGreaterEntryIndex(entry)]) {
+            count += node->countRemoves(entry.key);
+        }
+        return count;
+    }
+
+    /*
+     * returns the live entry with the key of entry that is followed by skip
+     * live ones with the key, nullptr if there is none
+    */
+    Node *lastLive(const Entry &entry, size_t skip, long &ind) {
+        long pos;
+        Node *node = root_->lowerBound(entry, pos, true);
+        while (true) {
+            long prev_ind;
+            Node *prev_node = node->prev(pos, prev_ind);
+            if ((prev_node == node && prev_ind == pos)
+                || !(prev_node->entries_[prev_ind].key == entry.key)) {
+                return nullptr;
+            }
+            node = prev_node;
+            pos = prev_ind;
+            if (!node->isErased(pos) && skip-- == 0) {
+                ind = pos;
+                return node;
+            }
+        }
+    }
+
+    /*
+     * findLive() that skips the entries erased by buffered removes
+    */
+    Node *findVisible(const Entry &entry, long &ind) {
+        size_t removes = buffered_ == 0 ? 0 : countBufferedRemoves(entry);
+        if (removes == 0) {
+            return findLive(entry, ind);
+        }
+        if (countLive(entry) <= removes) {
+            return nullptr;
+        }
+
+        // the hash index may give any live entry, the first one is kept
+        Node *node = root_->lowerBound(entry, ind);
+        if (node->isErased(ind)) {
+            node = node->nextLive(ind, ind);
+        }
+        return node;
+    }
+
+    /*
+     * buffers a remove of the key of entry at the root and returns number
+     * of elements removed (0 or 1)
+    */
+    int bufferRemove(const Entry &entry, Entry *removed) {
+        long ind;
+        size_t removes = countBufferedRemoves(entry);
+        Node *node = removes == 0 && removed == nullptr
+            ? findLive(entry, ind) : lastLive(entry, removes, ind);
+        if (node == nullptr) {
+            return 0;
+        }
+
+        if (removed != nullptr) {
+            *removed = node->entries_[ind];
+        }
+        root_->addRemove(entry.key);
+        size_--;
+        buffered_++;
+        flushFullRoot();
+        return 1;
+    }
+
+    /*
+     * returns the first node on the path of entry that buffers an insert
+     * with its key, nullptr if there is none
+    */
+    Node *messageHolder(const Entry &entry, size_t &ind) const {
+        for (Node *node = root_; node != nullptr && !node->is_leaf_;
+             node = node->children_[node->findFirstGreaterEntryIndex(entry)]) {
+            auto [first, last] = node->findMessages(entry);
+            if (first != last) {
+                ind = first;
+                return node;
+            }
+        }
+        return nullptr;
+    }
+
+    /*
+     * removes one buffered insert with the key of entry and returns false
+     * if there is none
+    */
+    bool dropMessage(const Entry &entry, Entry *removed) {
+        size_t ind;
+        Node *holder = messageHolder(entry, ind);
+        if (holder == nullptr) {
+            return false;
+        }
+
+        settleAppends();
+        std::vector<Entry> taken;
+        holder->takeMessages(ind, ind + 1, taken);
+        if (holder->parent_ != nullptr) {
+            holder->parent_->addToPathBuffered(-1);
+            holder->parent_->refreshAggregatesToRoot();
+        }
+        size_--;
+        buffered_--;
+
+        if (removed != nullptr) {
+            *removed = std::move(taken[0]);
+        }
+        return true;
+    }
+
+    /*
+     * moves the buffered messages with the key of entry from the buffers on
+     * its path into the tree
+    */
+    void applyMessages(const Entry &entry) {
+        std::vector<Node *> path;
+        for (Node *node = root_; node != nullptr && !node->is_leaf_;
+             node = node->children_[node->findFirstGreaterEntryIndex(entry)]) {
+            path.push_back(node);
+        }
+
+        std::vector<Entry> taken;
+        size_t removes = 0;
+        for (auto node = path.rbegin(); node != path.rend(); ++node) {
+            if ((*node)->countRemoves(entry.key) != 0) {
+                settleAppends();
+                auto count = static_cast<long>((*node)->takeRemoves(entry));
+                removes += count;
+                if ((*node)->parent_ != nullptr) {
+                    (*node)->parent_->addToPathBuffered(count);
+                }
+            }
+
+            auto [first, last] = (*node)->findMessages(entry);
+            if (first == last) {
+                continue;
+            }
+
+            settleAppends();
+            (*node)->takeMessages(first, last, taken);
+            if ((*node)->parent_ != nullptr) {
+                auto count = static_cast<long>(last - first);
+                (*node)->parent_->addToPathBuffered(-count);
+                (*node)->parent_->refreshAggregatesToRoot();
+            }
+        }
+
+        if (removes != 0) {
+            long ind;
+            Node *node = root_->lowerBound(entry, ind, true);
+            for (size_t i = 0; i < removes; ++i) {
+                node->eraseLastLive(ind, entry.key);
+            }
+            buffered_ -= removes;
+            tombstones_ += removes;
+        }
+
+        size_ -= taken.size();
+        buffered_ -= taken.size();
+        for (Entry &message : taken) {
+            long pos;
+            insertEntry(std::move(message), pos);
+        }
+    }
+
+    /*
+     * returns number of buffered inserts with the key of entry
+    */
+    size_t countMessages(const Entry &entry) const {
+        size_t count = 0;
+        for (Node *node = root_; node != nullptr && !node->is_leaf_;
+             node = node->children_[node->findFirstGreaterEntryIndex(entry)]) {
+            auto [first, last] = node->findMessages(entry);
+            count += last - first;
+        }
+        return count;
+    }
+
+    /*
+     * single descent lookup of key that inserts make_value() under key
+     * when no live entry has it
+    */
+    template<typename MakeValue>
+    typename Node::EmplaceResult emplaceUnique(const K &key,
+                                               MakeValue make_value) {
+        Entry probe;
+        probe.key = key;
+
+        // applied messages may take the append path, so they are settled
+        // after them, before the right-most leaf is forgotten
+        if (buffered_ != 0) {
+            applyMessages(probe);
+        }
+        settleAppends();
+        right_most_leaf_ = nullptr;
+
+        if (root_ == nullptr) {
+            long pos;
+            Node *node = insertEntry(Entry(key, make_value()), pos);
+            return {node, pos, true, false};
+        }
+
+        if (root_->isNodeFull()) {
+            splitRoot();
+        }
+
+        // an erased entry met on the way down may hide a live duplicate
+        if (tombstones_ != 0) {
+            long ind;
+            Node *node = findLive(probe, ind);
+            if (node != nullptr) {
+                return {node, ind, false, false};
+            }
+        }
+
+        auto result = root_->findOrInsert(probe, make_value);
+        if (result.inserted) {
+            size_++;
+            result.node->indexEntry(result.ind);
+        }
+        if (result.revived) {
+            tombstones_--;
+        }
+        return result;
+    }
+
+    /*
+     * turns a position returned by Node::lowerBound for key into an
+     * iterator of the merged order
+    */
+    Iterator liveIterator(Node *node, long ind, const K &key, bool strict) {
+        if (buffered_ == 0) {
+            if (ind < node->number_of_entries_ && node->isErased(ind)) {
+                node = node->nextLive(ind, ind);
+            }
+            return Iterator(node, ind);
+        }
+
+        Iterator it(node, ind, true);
+        long gap;
+        Node *leaf = node->gapBefore(ind, gap);
+        while (leaf->nextInGap(gap, it.holder_, it.at_)) {
+            const K &message = it.holder_->buffer()->messages[it.at_].key;
+            if (strict ? key < message : !(message < key)) {
+                it.node_ = leaf;
+                it.ind_ = gap;
+                return it;
+            }
+        }
+
+        it.holder_ = nullptr;
+        it.at_ = 0;
+        if (ind < node->number_of_entries_
+            && (node->isErased(ind) || node->isClaimed(ind))) {
+            it.node_ = node->nextMerged(ind, it.holder_, it.at_, it.ind_);
+        }
+        return it;
+    }
+
+    /*
+     * applies update to the value of an entry and refreshes the cached
+     * aggregates on the way up to the root
+    */
+    template<typename Update>
+    void updateInPlace(Node *node, long ind, Update &&update) {
+        settleAppends();
+        update(node->entries_[ind].value);
+        node->refreshAggregatesToRoot();
+    }
+
+    /*
+     * detached tree used while splitting and joining,
+     * height is -1 for the empty tree and 0 for a single leaf
+    */
+    struct Subtree {
+        Node *root;
+        long height;
+    };
+
+    Subtree wholeTree() const {
+        long height = -1;
+        for (Node *node = root_; node != nullptr;
+             node = node->is_leaf_ ? nullptr : node->children_[0]) {
+            height++;
+        }
+        return {root_, height};
+    }
+
+    /*
+     * returns a tree of the entries of left, separator and the entries of
+     * right, which must be in key order
+    */
+    Subtree join3(Subtree left, Entry &&separator, Subtree right) {
+        if (left.height < 0 && right.height < 0) {
+            Node *leaf = new Node(min_degree_, nullptr, true);
+            leaf->equip(countsSubtrees(), needsExtras());
+            leaf->entries_[0] = std::move(separator);
+            leaf->number_of_entries_ = 1;
+            leaf->refreshSummary();
+            return {leaf, 0};
+        }
+
+        if (left.height == right.height) {
+            Node *root = new Node(min_degree_, nullptr, false);
+            root->equip(countsSubtrees(), needsExtras());
+            root->entries_[0] = std::move(separator);
+            root->children_[0] = left.root;
+            root->children_[1] = right.root;
+            root->number_of_entries_ = 1;
+            left.root->parent_ = root;
+            right.root->parent_ = root;
+
+            if (left.root->number_of_entries_ + right.root->number_of_entries_
+                < 2 * min_degree_ - 1) {
+                root->merge(0);
+                Node *child = root->children_[0];
+                root->children_[0] = nullptr;
+                delete root;
+                child->parent_ = nullptr;
+                return {child, left.height};
+            }
+
+            root->fixUnderfullChild(0);
+            root->fixUnderfullChild(1);
+            root->refreshSummary();
+            return {root, left.height + 1};
+        }
+
+        if (left.height > right.height) {
+            if (left.root->isNodeFull()) {
+                left = {splitSubtreeRoot(left.root), left.height + 1};
+            }
+
+            // right spine of left down to the height right.root belongs at
+            Node *node = left.root;
+            for (long h = left.height; h > right.height + 1; --h) {
+                long last = node->number_of_entries_;
+                if (node->children_[last]->isNodeFull()) {
+                    node->splitChild(last);
+                    last++;
+                }
+                node = node->children_[last];
+            }
+
+            long n = node->number_of_entries_;
+            node->entries_[n] = std::move(separator);
+            node->setErased(n, false);
+            node->number_of_entries_++;
+            if (right.height >= 0) {
+                node->children_[n + 1] = right.root;
+                right.root->parent_ = node;
+                // the old last child is no longer on the right edge
+                node->fixUnderfullChild(n);
+                node->fixUnderfullChild(node->number_of_entries_);
+            }
+            node->refreshPathToRoot();
+            return left;
+        }
+
+        if (right.root->isNodeFull()) {
+            right = {splitSubtreeRoot(right.root), right.height + 1};
+        }
+
+        Node *node = right.root;
+        for (long h = right.height; h > left.height + 1; --h) {
+            if (node->children_[0]->isNodeFull()) {
+                node->splitChild(0);
+            }
+            node = node->children_[0];
+        }
+
+        for (long i = node->number_of_entries_; i > 0; --i) {
+            node->moveEntry(i, node, i - 1);
+        }
+        node->entries_[0] = std::move(separator);
+        node->setErased(0, false);
+        if (left.height >= 0) {
+            for (long i = node->number_of_entries_ + 1; i > 0; --i) {
+                node->children_[i] = node->children_[i - 1];
+            }
+            node->children_[0] = left.root;
+            left.root->parent_ = node;
+        }
+        node->number_of_entries_++;
+        if (left.height >= 0) {
+            node->fixUnderfullChild(0);
+        }
+        node->refreshPathToRoot();
+        return right;
+    }
+
+    /*
+     * fills the right spine of a tree that join() is about to graft inside
+     * another tree
+    */
+    static Subtree fillRightSpine(Subtree tree) {
+        std::vector<Node *> spine;
+        for (Node *node = tree.root; !node->is_leaf_;
+             node = node->children_[node->number_of_entries_]) {
+            spine.push_back(node);
+        }
+
+        for (auto it = spine.rbegin(); it != spine.rend(); ++it) {
+            (*it)->fixUnderfullChild((*it)->number_of_entries_);
+        }
+
+        if (tree.root->number_of_entries_ == 0 && !tree.root->is_leaf_) {
+            Node *old_root = tree.root;
+            tree = {old_root->children_[0], tree.height - 1};
+            tree.root->parent_ = nullptr;
+            old_root->children_[0] = nullptr;
+            old_root->is_leaf_ = true;
+            delete old_root;
+        }
+        return tree;
+    }
+
+    /*
+     * returns the detached piece made of entries_[from, to) of node and the
+     * children around them
+    */
+    Subtree pieceOf(Node *node, long height, long from, long to) {
+        if (from > to) {
+            return {nullptr, -1};
+        }
+
+        if (from == to && !node->is_leaf_) {
+            Node *child = node->children_[from];
+            child->parent_ = nullptr;
+            return {child, height - 1};
+        }
+
+        if (from == to) {
+            return {nullptr, -1};
+        }
+
+        Node *piece = new Node(min_degree_, nullptr, node->is_leaf_);
+        piece->equip(countsSubtrees(), needsExtras());
+        piece->number_of_entries_ = to - from;
+        for (long i = from; i < to; ++i) {
+            piece->moveEntry(i - from, node, i);
+        }
+        if (!node->is_leaf_) {
+            for (long i = from; i <= to; ++i) {
+                piece->children_[i - from] = node->children_[i];
+                piece->children_[i - from]->parent_ = piece;
+            }
+        }
+        piece->refreshSummary();
+        return {piece, height};
+    }
+
+    /*
+     * splits the subtree of node into the entries less than probe and the
+     * rest and frees node
+    */
+    std::pair<Subtree, Subtree> splitSubtree(Node *node, long height,
+                                             const Entry &probe) {
+        long ind = node->findUpperBoundEntryIndex(probe);
+        long n = node->number_of_entries_;
+
+        std::pair<Subtree, Subtree> result;
+        if (node->is_leaf_) {
+            result = {pieceOf(node, height, 0, ind),
+                      pieceOf(node, height, ind, n)};
+        } else {
+            auto [left, right] = splitSubtree(node->children_[ind],
+                                              height - 1, probe);
+            if (ind > 0) {
+                Entry separator = std::move(node->entries_[ind - 1]);
+                left = join3(pieceOf(node, height, 0, ind - 1),
+                             std::move(separator), left);
+            }
+            if (ind < n) {
+                Entry separator = std::move(node->entries_[ind]);
+                right = join3(right, std::move(separator),
+                              pieceOf(node, height, ind + 1, n));
+            }
+            result = {left, right};
+        }
+
+        node->number_of_entries_ = 0;
+        node->is_leaf_ = true;
+        delete node;
+        return result;
+    }
+
+    /*
+     * empty tree with the same degree and settings
+    */
+    BTree<K, V, A> emptyLike() const {
+        BTree<K, V, A> tree(min_degree_);
+        tree.order_statistics_ = order_statistics_;
+        tree.lazy_deletion_ = lazy_deletion_;
+        tree.max_tombstone_ratio_ = max_tombstone_ratio_;
+        tree.write_buffer_capacity_ = write_buffer_capacity_;
+        tree.memory_accounting_ = memory_accounting_;
+        tree.top_levels_.max_bytes = top_levels_.max_bytes;
+        if constexpr (Hashable<K>) {
+            if (hash_index_ != nullptr) {
+                tree.hash_index_ = new HashIndex;
+            }
+        }
+        return tree;
+    }
+
+    /*
+     * takes over a detached tree of size entries without erased ones
+    */
+    void adopt(Subtree subtree, size_t size) {
+        settleAppends();
+        delete root_;
+        root_ = subtree.root;
+        right_most_leaf_ = nullptr;
+        tombstones_ = 0;
+        size_ = size;
+        rebuildHashIndex();
+        top_levels_.root = nullptr;
+    }
+
+    /*
+     * moves the finger (node, ind) to the first entry not less than entry,
+     * which must not be less than the entry under the finger,
+     * a null node starts the search from the root
+    */
+    Node *advanceFinger(Node *node, long &ind, const Entry &entry) {
+        if (node == nullptr) {
+            return root_->lowerBound(entry, ind);
+        }
+        if (ind == node->number_of_entries_) {
+            return node;
+        }
+        return node->lowerBoundFrom(ind, entry, ind);
+    }
+
+    /*
+     * true if probing small keys one by one with a finger,
+     * O(small * log(large / small)), beats a linear merge
+    */
+    static bool preferGalloping(size_t small, size_t large) {
+        if (small == 0) {
+            return true;
+        }
+        return small * (std::bit_width(large / small) + 1) < large;
+    }
+
+    /*
+     * entries of this tree whose keys are (present) or are not (!present)
+     * in other, found by probing other for every key of this tree
+    */
+    std::vector<Entry> probeEach(BTree<K, V, A> &other, bool present) {
+        std::vector<Entry> entries;
+        Node *node = nullptr;
+        long ind = 0;
+
+        const Iterator a_end = end();
+        for (Iterator it = begin(); it != a_end;) {
+            Entry probe;
+            probe.key = it->key;
+
+            bool found = false;
+            if (other.root_ != nullptr) {
+                node = other.advanceFinger(node, ind, probe);
+                long live_ind = ind;
+                for (Node *live = node; live->isEntryPresent(probe, live_ind);
+                     live = live->next(live_ind, live_ind)) {
+                    if (!live->isErased(live_ind)) {
+                        found = true;
+                        break;
+                    }
+                }
+            }
+
+            for (; it != a_end && it->key == probe.key; ++it) {
+                if (found == present) {
+                    entries.push_back(*it);
+                }
+            }
+        }
+        return entries;
+    }
+
+    /*
+     * entries of this tree whose keys are in other, found by probing
+     * this tree for every key of other
+    */
+    std::vector<Entry> probeFrom(BTree<K, V, A> &other) {
+        std::vector<Entry> entries;
+        Node *node = nullptr;
+        long ind = 0;
+
+        if (root_ == nullptr) {
+            return entries;
+        }
+
+        const Iterator b_end = other.end();
+        for (Iterator it = other.begin(); it != b_end;) {
+            Entry probe;
+            probe.key = it->key;
+
+            node = advanceFinger(node, ind, probe);
+            while (node->isEntryPresent(probe, ind)) {
+                if (!node->isErased(ind)) {
+                    entries.push_back(node->entries_[ind]);
+                }
+                node = node->next(ind, ind);
+            }
+
+            for (; it != b_end && it->key == probe.key; ++it) {
+            }
+        }
+        return entries;
+    }
+
+    /*
+     * merges the live entries of both trees in one pass; entries with keys
+     * only in this tree, only in other or in both are kept as requested,
+     * for keys in both only the entries of this tree are kept
+    */
+    std::vector<Entry> mergeLinear(BTree<K, V, A> &other, bool only_this,
+                                   bool only_other, bool both) {
+        std::vector<Entry> entries;
+        Iterator a = begin();
+        Iterator b = other.begin();
+        const Iterator a_end = end(), b_end = other.end();
+
+        while (a != a_end || b != b_end) {
+            if ((!only_this && b == b_end)
+                || (!only_other && a == a_end)) {
+                break;
+            }
+
+            if (b == b_end || (a != a_end && *a < *b)) {
+                if (only_this) {
+                    entries.push_back(*a);
+                }
+                ++a;
+            } else if (a == a_end || *b < *a) {
+                if (only_other) {
+                    entries.push_back(*b);
+                }
+                ++b;
+            } else {
+                Entry probe;
+                probe.key = a->key;
+                for (; a != a_end && *a == probe; ++a) {
+                    if (both) {
+                        entries.push_back(*a);
+                    }
+                }
+                for (; b != b_end && *b == probe; ++b) {
+                }
+            }
+        }
+        return entries;
+    }
+
+    /*
+     * subtree sizes are kept for order statistics and for the per subtree
+     * tombstone ratio of lazy removes, see compactAround()
+    */
+    bool countsSubtrees() const {
+        return order_statistics_ || lazy_deletion_;
+    }
+
+    /*
+     * returns whether the nodes carry Extras, which only features with per
+     * node state need
+    */
+    bool needsExtras() const {
+        return countsSubtrees() || write_buffer_capacity_ != 0
+            || hash_index_ != nullptr || memory_accounting_;
+    }
+
+    /*
+     * matches the counts and the Extras of every node to the settings of
+     * the tree
+    */
+    void recount() {
+        settleAppends();
+        if (root_ != nullptr) {
+            root_->setCounted(countsSubtrees(), needsExtras());
+        }
+    }
+
+    void requireOrderStatistics() const {
+        if (!order_statistics_) {
+            throw std::logic_error("order statistics are not enabled");
+        }
+    }
+
+    BTree<K, V, A> treeOf(std::vector<Entry> &entries) const {
+        BTree<K, V, A> tree = emptyLike();
+        tree.buildFromSorted(entries);
+        return tree;
+    }
+
+  public:
+
+    // min_degree >= 3
+    explicit BTree(long min_degree) : root_(nullptr),
+                                      min_degree_(min_degree),
+                                      size_(0),
+                                      tombstones_(0),
+                                      right_most_leaf_(nullptr),
+                                      unsettled_appends_(0),
+                                      unsettled_aggregate_(A::identity()),
+                                      order_statistics_(false),
+                                      lazy_deletion_(false),
+                                      max_tombstone_ratio_(0.5),
+                                      write_buffer_capacity_(0),
+                                      buffered_(0),
+                                      memory_accounting_(false),
+                                      hash_index_(nullptr) {
+        if (min_degree < 3) {
+            throw std::invalid_argument(
+                "min degree must be greater or equal than 3");
+        }
+    }
+
+    BTree(const BTree<K, V, A> &other) : root_(other.root_),
+                                      min_degree_(other.min_degree_),
+                                      size_(other.size_),
+                                      tombstones_(other.tombstones_),
+                                      right_most_leaf_(nullptr),
+                                      unsettled_appends_(0),
+                                      unsettled_aggregate_(A::identity()),
+                                      order_statistics_(
+                                          other.order_statistics_),
+                                      lazy_deletion_(other.lazy_deletion_),
+                                      max_tombstone_ratio_(
+                                          other.max_tombstone_ratio_),
+                                      write_buffer_capacity_(
+                                          other.write_buffer_capacity_),
+                                      buffered_(other.buffered_),
+                                      memory_accounting_(
+                                          other.memory_accounting_),
+                                      hash_index_(nullptr) {
+        other.settleAppends();
+        if (root_ != nullptr) {
+            root_ = other.root_->copyNode(nullptr);
+        }
+        top_levels_.max_bytes = other.top_levels_.max_bytes;
+
+        if constexpr (Hashable<K>) {
+            if (other.hash_index_ != nullptr) {
+                hash_index_ = new HashIndex;
+                rebuildHashIndex();
+            }
+        }
+    }
+
+    BTree<K, V, A> &operator=(const BTree<K, V, A> &other) {
+        BTree<K, V, A> tmp(other);
+        swap(tmp);
+        return *this;
+    }
+
+    BTree(BTree<K, V, A> &&other) noexcept : BTree(other.min_degree_) {
+        swap(other);
+    }
+
+    BTree<K, V, A> &operator=(BTree<K, V, A> &&other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    void swap(BTree<K, V, A> &other) {
+        settleAppends();
+        other.settleAppends();
+        std::swap(root_, other.root_);
+        std::swap(min_degree_, other.min_degree_);
+        std::swap(size_, other.size_);
+        std::swap(tombstones_, other.tombstones_);
+        std::swap(right_most_leaf_, other.right_most_leaf_);
+        std::swap(order_statistics_, other.order_statistics_);
+        std::swap(lazy_deletion_, other.lazy_deletion_);
+        std::swap(max_tombstone_ratio_, other.max_tombstone_ratio_);
+        std::swap(write_buffer_capacity_, other.write_buffer_capacity_);
+        std::swap(buffered_, other.buffered_);
+        std::swap(memory_accounting_, other.memory_accounting_);
+        std::swap(hash_index_, other.hash_index_);
+        std::swap(top_levels_, other.top_levels_);
+    }
+
+    ~BTree() {
+        delete root_;
+        if constexpr (Hashable<K>) {
+            delete hash_index_;
+        }
+    }
+
+    void traverse(std::ostream &out) const {
+        if (root_ != nullptr) { root_->traverse(out); }
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    /*
+     * buffers inserts and removes at the internal nodes until they hold
+     * capacity messages, 0 turns buffering off
+    */
+    void setWriteBuffer(size_t capacity) requires CommutativeAggregate<A> {
+        bool counted = countsSubtrees();
+        bool extras = needsExtras();
+        write_buffer_capacity_ = capacity;
+        if (capacity == 0) {
+            flush();
+            if (!lazy_deletion_) {
+                compactTombstones();
+            }
+        }
+        if (countsSubtrees() != counted || needsExtras() != extras) {
+            recount();
+        }
+    }
+
+    /*
+     * pushes all buffered messages into the leaves, iterators are
+     * invalidated
+    */
+    void flush() {
+        if (buffered_ != 0) {
+            flushBuffers(0);
+        }
+        settleAppends();
+    }
+
+    /*
+     * with order statistics every node counts the entries of its subtree,
+     * which rank(), select(), countRange() and moving iterators by more
+     * than one entry need; inserts and removals then add or subtract one
+     * on every node of their path; turning them on counts all subtrees,
+     * O(n / min_degree); without them rank(), select() and countRange()
+     * throw and iterator arithmetic steps over the entries one by one
+    */
+    void setOrderStatistics(bool enabled) {
+        bool counted = countsSubtrees();
+        bool extras = needsExtras();
+        order_statistics_ = enabled;
+        if (countsSubtrees() != counted || needsExtras() != extras) {
+            recount();
+        }
+    }
+
+    /*
+     * in lazy deletion mode remove() only marks the entry as erased and
+     * every node counts the live and erased entries of its subtree; once
+     * the erased entries of a subtree on the path of a remove make up
+     * more than max_tombstone_ratio of its stored entries, the lowest such
+     * subtree is rebuilt without them, with as many levels as before, so
+     * a remove pays for the region it emptied and not for the whole tree;
+     * a subtree too sparse to fill that many levels is rebuilt together
+     * with its neighbour, or with its parent if both are that sparse, and
+     * only when that reaches the root is the whole tree rebuilt; leaving
+     * the mode drops all erased entries
+    */
+    void setLazyDeletion(bool enabled, double max_tombstone_ratio = 0.5) {
+        bool counted = countsSubtrees();
+        bool extras = needsExtras();
+        lazy_deletion_ = enabled;
+        max_tombstone_ratio_ = max_tombstone_ratio;
+
+        if (!enabled) {
+            compactTombstones();
+        }
+        if (countsSubtrees() != counted || needsExtras() != extras) {
+            recount();
+        }
+    }
+
+    size_t tombstones() const {
+        return tombstones_;
+    }
+
+    /*
+     * walks the whole tree and reports its shape
+    */
+    Stats stats() const {
+        Stats stats;
+        if (root_ != nullptr) {
+            root_->collectStats(stats, 0, true);
+            stats.fill_factor = static_cast<double>(stats.entries)
+                / static_cast<double>(stats.nodes * (2 * min_degree_ - 1));
+        }
+
+        if constexpr (Hashable<K>) {
+            if (hash_index_ != nullptr) {
+                stats.hash_index_keys = hash_index_->keys;
+                stats.hash_index_bytes = hashIndexBytes();
+                if (hash_index_->keys != 0) {
+                    stats.hash_index_bytes_per_key =
+                        static_cast<double>(stats.hash_index_bytes)
+                        / static_cast<double>(hash_index_->keys);
+                }
+                stats.hash_index_updates = hash_index_->updates;
+            }
+        }
+        return stats;
+    }
+
+    /*
+     * returns number of bytes allocated by the tree for its nodes, the hash
+     * index, the flattened top levels and the node buffers
+    */
+    size_t memoryUsage() const {
+        size_t bytes = root_ == nullptr ? 0 : root_->subtreeBytes();
+        bytes += hashIndexBytes();
+        bytes += top_levels_.bytes();
+        // emptied buffers are freed, so there are none without messages
+        if (buffered_ != 0) {
+            bytes += root_->bufferBytes();
+        }
+        return bytes;
+    }
+
+    /*
+     * makes every node sum the bytes of its subtree, so memoryUsage() takes
+     * O(1)
+    */
+    void setMemoryAccounting(bool enabled) {
+        bool extras = needsExtras();
+        memory_accounting_ = enabled;
+        if (needsExtras() != extras) {
+            recount();
+        }
+    }
+
+    /*
+     * with the hash index search() and remove() find the node holding a
+     * key without descending the tree
+    */
+    void setHashIndex(bool enabled) requires Hashable<K> {
+        if (enabled == (hash_index_ != nullptr)) {
+            return;
+        }
+
+        bool extras = needsExtras();
+        if (enabled) {
+            hash_index_ = new HashIndex;
+            if (!extras) {
+                recount();
+            }
+            rebuildHashIndex();
+            return;
+        }
+
+        if (root_ != nullptr) {
+            root_->attachHashIndex(nullptr);
+        }
+        delete hash_index_;
+        hash_index_ = nullptr;
+        if (needsExtras() != extras) {
+            recount();
+        }
+    }
+
+    /*
+     * resolves the first levels of search() in a pointer-free array image
+     * of their keys, which takes as many whole internal levels as fit
+     * into max_bytes and is rebuilt on the next search after a change
+     * reaches those levels, so it pays off for read-mostly trees; 0 turns
+     * it off
+    */
+    void setFlatTopLevels(long max_bytes) {
+        if (max_bytes < 0) {
+            throw std::invalid_argument("max bytes must not be negative");
+        }
+
+        top_levels_ = TopLevels();
+        top_levels_.max_bytes = max_bytes;
+    }
+
+    /*
+     * rebuilds the tree bottom-up without the erased entries
+    */
+    void compactTombstones() {
+        if (tombstones_ == 0) {
+            return;
+        }
+        flush();
+
+        std::vector<Entry> entries;
+        entries.reserve(size_);
+        root_->collectLive(entries);
+        buildFromSorted(entries);
+    }
+
+    /*
+     * rebuilds the tree with every node about fill of its capacity,
+     * iterators are invalidated
+    */
+    void repack(double fill = 1.0) {
+        flush();
+
+        std::vector<Entry> entries;
+        entries.reserve(size_);
+        if (root_ != nullptr) {
+            root_->collectLive(entries);
+        }
+
+        auto capacity = static_cast<double>(2 * min_degree_ - 1);
+        buildFromSorted(entries, std::lround(fill * capacity));
+    }
+
+    /*
+     * moves the entries with keys less than key into the first tree and the
+     * rest into the second one
+    */
+    std::pair<BTree<K, V, A>, BTree<K, V, A>> splitAt(const K &key) {
+        flush();
+        compactTombstones();
+
+        Entry probe;
+        probe.key = key;
+
+        std::pair<BTree<K, V, A>, BTree<K, V, A>> trees(emptyLike(),
+                                                        emptyLike());
+        if (root_ != nullptr) {
+            Subtree whole = wholeTree();
+            root_ = nullptr;
+            auto [left, right] = splitSubtree(whole.root, whole.height,
+                                              probe);
+            size_t left_size = 0;
+            if (left.root != nullptr && left.root->counted_) {
+                left_size = left.root->extras_->subtree_size;
+            } else if (left.root != nullptr) {
+                Stats stats;
+                left.root->collectStats(stats, 0, true);
+                left_size = stats.entries;
+            }
+            trees.first.adopt(left, left_size);
+            trees.second.adopt(right, size_ - left_size);
+        }
+
+        size_ = 0;
+        right_most_leaf_ = nullptr;
+        rebuildHashIndex();
+        return trees;
+    }
+
+    /*
+     * returns a tree with the entries of left followed by those of right,
+     * whose keys must not be less than any key of left
+    */
+    static BTree<K, V, A> join(BTree<K, V, A> &&left, BTree<K, V, A> &&right) {
+        if (left.min_degree_ != right.min_degree_) {
+            throw std::invalid_argument("joined trees must have equal degree");
+        }
+
+        left.flush();
+        left.compactTombstones();
+        right.flush();
+        right.compactTombstones();
+        if (left.root_ != nullptr && right.root_ != nullptr
+            && right.root_->getMinEntryInSubtree()
+                < left.root_->getMaxEntryInSubtree()) {
+            throw std::invalid_argument("joined trees must not overlap");
+        }
+        if (right.root_ != nullptr
+            && (left.countsSubtrees() != right.countsSubtrees()
+                || left.needsExtras() != right.needsExtras())) {
+            right.root_->setCounted(left.countsSubtrees(), left.needsExtras());
+        }
+        size_t size = left.size_ + right.size_;
+
+        BTree<K, V, A> tree = left.emptyLike();
+        Subtree joined;
+        if (left.root_ == nullptr) {
+            joined = right.wholeTree();
+        } else if (right.root_ == nullptr) {
+            joined = left.wholeTree();
+        } else {
+            Entry separator = left.root_->removeMax();
+            if (left.root_->number_of_entries_ == 0) {
+                Node *old_root = left.root_;
+                left.root_ = old_root->is_leaf_ ? nullptr
+                                                : old_root->children_[0];
+                if (left.root_ != nullptr) {
+                    left.root_->parent_ = nullptr;
+                }
+                old_root->children_[0] = nullptr;
+                old_root->is_leaf_ = true;
+                delete old_root;
+            }
+
+            Subtree left_tree = left.wholeTree();
+            if (left_tree.height >= 0) {
+                left_tree = fillRightSpine(left_tree);
+            }
+            joined = tree.join3(left_tree, std::move(separator),
+                                right.wholeTree());
+        }
+
+        for (BTree<K, V, A> *source : {&left, &right}) {
+            source->root_ = nullptr;
+            source->size_ = 0;
+            source->right_most_leaf_ = nullptr;
+            source->rebuildHashIndex();
         }
+        tree.adopt(joined, size);
+        return tree;
+    }
 
-        friend class BTree;
-    };
+    /*
+     * returns a tree with the entries of this tree and the entries of
+     * other whose keys are not in this tree, both trees are unchanged;
+     * a single merge pass, O(n + m)
+    */
+    BTree<K, V, A> unionWith(BTree<K, V, A> &other) {
+        flush();
+        other.flush();
 
-    void insertIfRootIsFull(Entry entry) {
-        Node *new_root = new Node(min_degree_, nullptr, false);
-        new_root->children_[0] = root_;
-        root_->parent_ = new_root;
-        new_root->splitChild(0);
-        root_ = new_root;
+        std::vector<Entry> entries = mergeLinear(other, true, true, true);
+        return treeOf(entries);
+    }
 
-        if (entry <= new_root->entries_[0]) {
-            new_root->children_[0]->insertInNonFull(entry);
-            return;
+    /*
+     * returns a tree with the entries of this tree whose keys are in other,
+     * O(n + m), or O(m log(n / m)) plus the output when one tree
+     * holds m entries and is much smaller than the other one
+    */
+    BTree<K, V, A> intersect(BTree<K, V, A> &other) {
+        flush();
+        other.flush();
+
+        std::vector<Entry> entries;
+        if (preferGalloping(size_, other.size_)) {
+            entries = probeEach(other, true);
+        } else if (preferGalloping(other.size_, size_)) {
+            entries = probeFrom(other);
+        } else {
+            entries = mergeLinear(other, false, false, true);
         }
-        new_root->children_[1]->insertInNonFull(entry);
+        return treeOf(entries);
     }
 
-  public:
-
-    // min_degree >= 3
-    explicit BTree(long min_degree) : root_(nullptr),
-                                      min_degree_(min_degree),
-                                      size_(0) {
-        if (min_degree < 3) {
-            throw std::invalid_argument(
-                "min degree must be greater or equal than 3");
+    /*
+     * returns a tree with the entries of this tree whose keys are not in
+     * other, O(n + m), or O(n log(m / n)) when this tree is much smaller
+    */
+    BTree<K, V, A> difference(BTree<K, V, A> &other) {
+        flush();
+        other.flush();
+
+        std::vector<Entry> entries;
+        if (preferGalloping(size_, other.size_)) {
+            entries = probeEach(other, false);
+        } else {
+            entries = mergeLinear(other, true, false, false);
         }
+        return treeOf(entries);
     }
 
-    BTree(const BTree<K, V> &other) : root_(other.root_),
-                                      min_degree_(other.min_degree_),
-                                      size_(other.size_) {
-        if (root_ != nullptr) {
-            root_ = other.root_->copyNode(nullptr);
+    void insert(K key, V value) {
+        if (write_buffer_capacity_ != 0 && root_ != nullptr
+            && !root_->is_leaf_) {
+            root_->addMessage(Entry(std::move(key), std::move(value)));
+            size_++;
+            buffered_++;
+            flushFullRoot();
+            return;
         }
+
+        long pos;
+        insertEntry(Entry(std::move(key), std::move(value)), pos);
     }
 
-    BTree<K, V> &operator=(const BTree<K, V> &other) {
-        BTree<K, V> tmp(other);
-        swap(tmp);
-        return *this;
+    /*
+     * inserts the entry starting from the hint instead of the root,
+     * the cost grows with the distance between the hint and the key,
+     * returns iterator on the inserted entry
+    */
+    Iterator insert(Iterator hint, K key, V value) {
+        Entry entry(std::move(key), std::move(value));
+
+        long pos;
+        Node *node;
+        if (buffered_ != 0) {
+            // older buffered messages with the key go before the entry
+            applyMessages(entry);
+            node = insertEntry(std::move(entry), pos);
+        } else if (root_ == nullptr || hint.node_ == nullptr) {
+            node = insertEntry(std::move(entry), pos);
+        } else {
+            node = insertEntryNear(hint.node_, hint.ind_, std::move(entry),
+                                   pos);
+        }
+        settleAppends();
+        return Iterator(node, pos, buffered_ != 0);
     }
 
-    void swap(const BTree<K, V> &other) {
-        auto tmp_root = root_;
-        root_ = other.root_;
-        other.root_ = tmp_root;
+    /*
+     * returns number of elements removed (0 or 1)
+    */
+    int remove(K key) {
+        Entry entry;
+        entry.key = key;
 
-        auto tmp_size = size_;
-        size_ = other.size_;
-        other.size_ = tmp_size;
+        if (buffered_ != 0 && dropMessage(entry, nullptr)) {
+            return 1;
+        }
+        return removeEntry(entry);
+    }
 
-        auto tmp_min_degree = min_degree_;
-        min_degree_ = other.min_degree_;
-        other.min_degree_ = tmp_min_degree;
+    /*
+     * removes an entry with key in one descent and returns the value of
+     * that entry, std::nullopt if there is none
+    */
+    std::optional<V> extract(K key) {
+        Entry entry;
+        entry.key = std::move(key);
+        Entry removed;
+        if ((buffered_ == 0 || !dropMessage(entry, &removed))
+            && removeEntry(entry, &removed) == 0) {
+            return std::nullopt;
+        }
+        return std::move(removed.value);
     }
 
-    ~BTree() {
-        delete root_;
+    /*
+     * inserts V(args...) under key unless the key is present and returns
+     * the entry with whether it was inserted
+    */
+    template<typename... Args>
+    std::pair<Iterator, bool> try_emplace(K key, Args &&... args) {
+        auto result = emplaceUnique(key, [&args...]() {
+            return V(std::forward<Args>(args)...);
+        });
+        return {Iterator(result.node, result.ind, buffered_ != 0),
+                result.inserted};
     }
 
-    void traverse(std::ostream &out) const {
-        if (root_ != nullptr) { root_->traverse(out); }
+    /*
+     * inserts value under key or assigns it to the existing entry and
+     * returns the entry with whether it was inserted
+    */
+    std::pair<Iterator, bool> insert_or_assign(K key, V value) {
+        auto result = emplaceUnique(key, [&value]() {
+            return std::move(value);
+        });
+
+        if (!result.inserted) {
+            updateInPlace(result.node, result.ind, [&value](V &stored) {
+                stored = std::move(value);
+            });
+        }
+        return {Iterator(result.node, result.ind, buffered_ != 0),
+                result.inserted};
     }
 
-    size_t size() {
-        return size_;
+    /*
+     * applies update to the value stored under key, a missing key is
+     * inserted with update applied to V(); a single descent is made,
+     * returns iterator on the entry and whether it was inserted
+    */
+    template<typename Update>
+    std::pair<Iterator, bool> upsert(K key, Update update) {
+        auto result = emplaceUnique(key, [&update]() {
+            V value{};
+            update(value);
+            return value;
+        });
+
+        if (!result.inserted) {
+            updateInPlace(result.node, result.ind, update);
+        }
+        return {Iterator(result.node, result.ind, buffered_ != 0),
+                result.inserted};
     }
 
-    void insert(K key, V value) {
-        size_++;
-        Entry entry(key, value);
+    /*
+     * applies update to the value stored under key,
+     * returns false if the key is not present
+    */
+    template<typename Update>
+    bool modify(K key, Update update) {
+        Entry entry;
+        entry.key = key;
 
-        if (root_ == nullptr) {
-            root_ = new Node(min_degree_, nullptr, true);
-            root_->entries_[0] = entry;
-            root_->number_of_entries_ = 1;
-            return;
+        size_t at;
+        Node *holder = buffered_ == 0 ? nullptr : messageHolder(entry, at);
+        if (holder != nullptr) {
+            settleAppends();
+            update(holder->buffer()->messages[at].value);
+            holder->refreshBuffer();
+            holder->refreshAggregatesToRoot();
+            return true;
         }
 
-        if (root_->isNodeFull()) {
-            insertIfRootIsFull(entry);
-            return;
+        long ind;
+        Node *node = findVisible(entry, ind);
+        if (node == nullptr) {
+            return false;
         }
 
-        root_->insertInNonFull(entry);
+        updateInPlace(node, ind, update);
+        return true;
     }
 
     /*
-     * returns number of elements removed (0 or 1)
+     * returns iterator on the first entry with key greater or equal to key
     */
-    int remove(K key) {
+    Iterator lower_bound(K key) {
+        settleAppends();
         if (root_ == nullptr) {
-            return 0;
+            return end();
         }
 
         Entry entry;
         entry.key = key;
 
-        int number_of_removed_elems = root_->remove(entry);
-        size_ -= number_of_removed_elems;
+        long ind;
+        Node *node = root_->lowerBound(entry, ind);
+        return liveIterator(node, ind, entry.key, false);
+    }
 
-        if (root_->number_of_entries_ != 0) {
-            return number_of_removed_elems;
+    /*
+     * returns iterator on the first entry with key greater than key
+    */
+    Iterator upper_bound(K key) {
+        settleAppends();
+        if (root_ == nullptr) {
+            return end();
         }
 
-        Node *old_root = root_;
-        root_ = root_->is_leaf_ ? nullptr : root_->children_[0];
-        if (root_ != nullptr) {
-            root_->parent_ = nullptr;
+        Entry entry;
+        entry.key = key;
+
+        long ind;
+        Node *node = root_->lowerBound(entry, ind, true);
+        return liveIterator(node, ind, entry.key, true);
+    }
+
+    /*
+     * returns range of all entries with this key
+    */
+    std::pair<Iterator, Iterator> equal_range(K key) {
+        return {lower_bound(key), upper_bound(key)};
+    }
+
+    /*
+     * returns number of entries with this key
+    */
+    size_t count(K key) {
+        Entry entry;
+        entry.key = key;
+        if (buffered_ == 0) {
+            return countLive(entry);
         }
+        return countLive(entry) + countMessages(entry)
+            - countBufferedRemoves(entry);
+    }
 
-        for (long i = 0; i <= old_root->number_of_entries_; ++i) {
-            old_root->children_[i] = nullptr;
+    /*
+     * returns number of entries with key less than the given key,
+     * needs order statistics
+    */
+    size_t rank(K key) const {
+        requireOrderStatistics();
+        settleAppends();
+        if (root_ == nullptr) {
+            return 0;
         }
-        delete old_root;
 
-        return number_of_removed_elems;
+        Entry entry;
+        entry.key = key;
+        return root_->rank(entry);
+    }
+
+    /*
+     * returns number of entries with key in [lo, hi),
+     * needs order statistics
+    */
+    size_t countRange(K lo, K hi) const {
+        requireOrderStatistics();
+        if (!(lo < hi)) {
+            return 0;
+        }
+        return rank(hi) - rank(lo);
+    }
+
+    /*
+     * returns A::combine of the values with key in [lo, hi) in key order
+    */
+    AggregateValue reduce(K lo, K hi) const {
+        settleAppends();
+        if (root_ == nullptr || !(lo < hi)) {
+            return A::identity();
+        }
+        return root_->reduce(&lo, &hi);
+    }
+
+    /*
+     * returns A::combine of all values in key order
+    */
+    AggregateValue reduce() const {
+        settleAppends();
+        if (root_ == nullptr) {
+            return A::identity();
+        }
+        return root_->aggregate_;
     }
 
     struct Iterator {
@@ -564,66 +5150,37 @@ class BTree {
         using reference = Entry &;
 
         void increment() {
-            if (ind_ == node_->number_of_entries_) {
-                return;
-            }
-
-            if (!node_->is_leaf_) {
-                node_ = node_->children_[ind_ + 1]->getLeftMostLeaf();
-                ind_ = 0;
-                return;
-            }
-
-            auto leaf = node_;
-            ++ind_;
-            while (node_->parent_ != nullptr
-                && ind_ == node_->number_of_entries_) {
-                ind_ = node_->parent_->getChildIndex(node_);
-                node_ = node_->parent_;
-            }
-
-            if (ind_ == node_->number_of_entries_) {
-                ind_ = leaf->number_of_entries_;
-                node_ = leaf;
+            if (merged_) {
+                node_ = node_->nextMerged(ind_, holder_, at_, ind_);
+            } else {
+                node_ = node_->nextLive(ind_, ind_);
             }
         }
 
         void decrement() {
-            if (!node_->is_leaf_) {
-                node_ = node_->children_[ind_]->getRightMostLeaf();
-                ind_ = node_->number_of_entries_ - 1;
-                return;
-            }
-
-            if (ind_ > 0) {
-                --ind_;
-                return;
-            }
-
-            auto leaf = node_;
-            while (node_->parent_ != nullptr
-                && (ind_ = node_->parent_->getChildIndex(node_)) == 0) {
-                node_ = node_->parent_;
+            if (merged_) {
+                node_ = node_->prevMerged(ind_, holder_, at_, ind_);
+            } else {
+                node_ = node_->prevLive(ind_, ind_);
             }
-
-            if (ind_ == 0) {
-                node_ = leaf;
-                return;
-            }
-
-            --ind_;
-            node_ = node_->parent_;
         }
 
-        Iterator(Node *node, long ind) : node_(node), ind_(ind) {
+        // merged iterators also walk the buffered messages, see
+        // Node::nextMerged()
+        Iterator(Node *node, long ind, bool merged = false)
+            : node_(node), ind_(ind), holder_(nullptr), at_(0),
+              merged_(merged) {
         }
 
         reference operator*() const {
+            if (holder_ != nullptr) {
+                return holder_->buffer()->messages[at_];
+            }
             return node_->entries_[ind_];
         }
 
         pointer operator->() {
-            return node_->entries_ + ind_;
+            return &**this;
         }
 
         Iterator &operator++() {
@@ -648,9 +5205,43 @@ class BTree {
             return temp;
         }
 
+        /*
+         * moves the iterator by offset entries in O(log n) with order
+         * statistics and in O(offset) without
+        */
+        Iterator &operator+=(difference_type offset) {
+            if (node_ == nullptr) {
+                return *this;
+            }
+            if (merged_) {
+                node_ = node_->advanceMerged(ind_, holder_, at_, offset, ind_);
+            } else {
+                node_ = node_->advance(ind_, offset, ind_);
+            }
+            return *this;
+        }
+
+        Iterator &operator-=(difference_type offset) {
+            return *this += -offset;
+        }
+
+        friend Iterator operator+(Iterator it, difference_type offset) {
+            return it += offset;
+        }
+
+        friend Iterator operator-(Iterator it, difference_type offset) {
+            return it -= offset;
+        }
+
+        friend difference_type operator-(const Iterator &first,
+                                         const Iterator &second) {
+            return first.position() - second.position();
+        }
+
         friend bool operator==(const Iterator &first,
                                const Iterator &second) {
-            return first.node_ == second.node_ && first.ind_ == second.ind_;
+            return first.node_ == second.node_ && first.ind_ == second.ind_
+                && first.holder_ == second.holder_ && first.at_ == second.at_;
         }
 
         friend bool operator!=(const Iterator &first,
@@ -659,8 +5250,27 @@ class BTree {
         }
 
       private:
+        // in-order index, 0 for the end of an empty tree
+        difference_type position() const {
+            if (node_ == nullptr) {
+                return 0;
+            }
+            if (merged_) {
+                return static_cast<difference_type>(
+                    node_->mergedPosition(ind_, holder_, at_));
+            }
+            return static_cast<difference_type>(node_->position(ind_));
+        }
+
         Node *node_;
         long ind_;
+        // the buffered insert holder_->buffer()->messages[at_] in gap ind_
+        // of the leaf node_, nullptr for a stored entry
+        Node *holder_;
+        size_t at_;
+        bool merged_;
+
+        friend class BTree;
     };
 
     struct ConstIterator {
@@ -671,66 +5281,37 @@ class BTree {
         using reference = const Entry &;
 
         void increment() {
-            if (ind_ == node_->number_of_entries_) {
-                return;
-            }
-
-            if (!node_->is_leaf_) {
-                node_ = node_->children_[ind_ + 1]->getLeftMostLeaf();
-                ind_ = 0;
-                return;
-            }
-
-            auto leaf = node_;
-            ++ind_;
-            while (node_->parent_ != nullptr
-                && ind_ == node_->number_of_entries_) {
-                ind_ = node_->parent_->getChildIndex(node_);
-                node_ = node_->parent_;
-            }
-
-            if (ind_ == node_->number_of_entries_) {
-                ind_ = leaf->number_of_entries_;
-                node_ = leaf;
+            if (merged_) {
+                node_ = node_->nextMerged(ind_, holder_, at_, ind_);
+            } else {
+                node_ = node_->nextLive(ind_, ind_);
             }
         }
 
         void decrement() {
-            if (!node_->is_leaf_) {
-                node_ = node_->children_[ind_]->getRightMostLeaf();
-                ind_ = node_->number_of_entries_ - 1;
-                return;
-            }
-
-            if (ind_ > 0) {
-                --ind_;
-                return;
-            }
-
-            auto leaf = node_;
-            while (node_->parent_ != nullptr
-                && (ind_ = node_->parent_->getChildIndex(node_)) == 0) {
-                node_ = node_->parent_;
-            }
-
-            if (ind_ == 0) {
-                node_ = leaf;
-                return;
+            if (merged_) {
+                node_ = node_->prevMerged(ind_, holder_, at_, ind_);
+            } else {
+                node_ = node_->prevLive(ind_, ind_);
             }
-
-            --ind_;
-            node_ = node_->parent_;
         }
 
-        ConstIterator(Node *node, long ind) : node_(node), ind_(ind) {
+        // merged iterators also walk the buffered messages, see
+        // Node::nextMerged()
+        ConstIterator(Node *node, long ind, bool merged = false)
+            : node_(node), ind_(ind), holder_(nullptr), at_(0),
+              merged_(merged) {
         }
 
         reference operator*() const {
+            if (holder_ != nullptr) {
+                return holder_->buffer()->messages[at_];
+            }
             return node_->entries_[ind_];
         }
 
         pointer operator->() const {
-            return node_->entries_ + ind_;
+            return &**this;
         }
 
         ConstIterator &operator++() {
@@ -750,14 +5331,48 @@ class BTree {
         }
 
         ConstIterator operator--(int) {
-            Iterator temp = *this;
+            auto temp = *this;
             decrement();
             return temp;
         }
 
+        /*
+         * moves the iterator by offset entries in O(log n) with order
+         * statistics and in O(offset) without
+        */
+        ConstIterator &operator+=(difference_type offset) {
+            if (node_ == nullptr) {
+                return *this;
+            }
+            if (merged_) {
+                node_ = node_->advanceMerged(ind_, holder_, at_, offset, ind_);
+            } else {
+                node_ = node_->advance(ind_, offset, ind_);
+            }
+            return *this;
+        }
+
+        ConstIterator &operator-=(difference_type offset) {
+            return *this += -offset;
+        }
+
+        friend ConstIterator operator+(ConstIterator it, difference_type offset) {
+            return it += offset;
+        }
+
+        friend ConstIterator operator-(ConstIterator it, difference_type offset) {
+            return it -= offset;
+        }
+
+        friend difference_type operator-(const ConstIterator &first,
+                                         const ConstIterator &second) {
+            return first.position() - second.position();
+        }
+
         friend bool operator==(const ConstIterator &first,
                                const ConstIterator &second) {
-            return first.node_ == second.node_ && first.ind_ == second.ind_;
+            return first.node_ == second.node_ && first.ind_ == second.ind_
+                && first.holder_ == second.holder_ && first.at_ == second.at_;
         }
 
         friend bool operator!=(const ConstIterator &first,
@@ -766,8 +5381,26 @@ class BTree {
         }
 
       private:
+        difference_type position() const {
+            if (node_ == nullptr) {
+                return 0;
+            }
+            if (merged_) {
+                return static_cast<difference_type>(
+                    node_->mergedPosition(ind_, holder_, at_));
+            }
+            return static_cast<difference_type>(node_->position(ind_));
+        }
+
         Node *node_;
         long ind_;
+        // the buffered insert holder_->buffer()->messages[at_] in gap ind_
+        // of the leaf node_, nullptr for a stored entry
+        Node *holder_;
+        size_t at_;
+        bool merged_;
+
+        friend class BTree;
     };
 
     /*
@@ -775,14 +5408,69 @@ class BTree {
      * otherwise returns iterator on end
      */
     Iterator search(K key) {
+        Entry entry;
+        entry.key = key;
+
+        if (buffered_ != 0) {
+            applyMessages(entry);
+        }
+        // iterator arithmetic reads the counts of the ancestors
+        settleAppends();
+
         if (root_ == nullptr) {
             return end();
         }
 
+        long ind;
+        Node *node = findLive(entry, ind);
+        if (node == nullptr) {
+            return end();
+        }
+
+        return Iterator(node, ind, buffered_ != 0);
+    }
+
+    /*
+     * returns pointer on the value of an entry with key, nullptr if there
+     * is none; unlike search() a miss does not walk to end(), the pointer
+     * may point into a node buffer and is valid until the next call other
+     * than lookup(), modify() and the const ones
+    */
+    V *lookup(K key) {
+        if (root_ == nullptr) {
+            return nullptr;
+        }
+
+        Entry entry;
+        entry.key = std::move(key);
+
+        size_t at;
+        Node *holder = buffered_ == 0 ? nullptr : messageHolder(entry, at);
+        if (holder != nullptr) {
+            return &holder->buffer()->messages[at].value;
+        }
+
+        long ind;
+        Node *node = findVisible(entry, ind);
+        return node == nullptr ? nullptr : &node->entries_[ind].value;
+    }
+
+    /*
+     * same as search(key) but starts from the hint instead of the root,
+     * the cost grows with the distance between the hint and the key
+    */
+    Iterator search(Iterator hint, K key) {
+        if (root_ == nullptr || hint.node_ == nullptr || tombstones_ != 0
+            || buffered_ != 0) {
+            return search(key);
+        }
+        settleAppends();
+
         Entry entry;
         entry.key = key;
 
-        Node *node = root_->search(entry);
+        Node *start = hint.node_->coveringAncestor(hint.ind_, entry);
+        Node *node = start->search(entry);
         if (node == nullptr) {
             return end();
         }
@@ -790,23 +5478,83 @@ class BTree {
         return Iterator(node, node->findUpperBoundEntryIndex(entry));
     }
 
+    /*
+     * returns iterator on the entry with in-order index "index",
+     * otherwise returns iterator on end; needs order statistics
+    */
+    Iterator select(size_t index) {
+        requireOrderStatistics();
+        flush();
+        if (root_ == nullptr || index >= size_) {
+            return end();
+        }
+
+        long ind;
+        Node *node = root_->select(index, ind);
+        return Iterator(node, ind);
+    }
+
     Iterator begin() {
-        return Iterator(root_->getLeftMostLeaf(), 0);
+        settleAppends();
+        if (root_ == nullptr) {
+            return end();
+        }
+
+        Node *leaf = root_->getLeftMostLeaf();
+        if (buffered_ != 0) {
+            Iterator it(leaf, 0, true);
+            it.node_ = leaf->firstMerged(0, it.holder_, it.at_, it.ind_);
+            return it;
+        }
+        if (!leaf->isErased(0)) {
+            return Iterator(leaf, 0);
+        }
+
+        long ind;
+        Node *node = leaf->nextLive(0, ind);
+        return Iterator(node, ind);
     }
 
     Iterator end() {
+        settleAppends();
+        if (root_ == nullptr) {
+            return Iterator(nullptr, 0);
+        }
         auto right_most_leaf = root_->getRightMostLeaf();
-        return Iterator(right_most_leaf, right_most_leaf->number_of_entries_);
+        return Iterator(right_most_leaf, right_most_leaf->number_of_entries_,
+                        buffered_ != 0);
     }
 
-    Iterator cbegin() const {
-        return ConstIterator(root_->getLeftMostLeaf(), 0);
+    ConstIterator cbegin() const {
+        settleAppends();
+        if (root_ == nullptr) {
+            return cend();
+        }
+
+        Node *leaf = root_->getLeftMostLeaf();
+        if (buffered_ != 0) {
+            ConstIterator it(leaf, 0, true);
+            it.node_ = leaf->firstMerged(0, it.holder_, it.at_, it.ind_);
+            return it;
+        }
+        if (!leaf->isErased(0)) {
+            return ConstIterator(leaf, 0);
+        }
+
+        long ind;
+        Node *node = leaf->nextLive(0, ind);
+        return ConstIterator(node, ind);
     }
 
-    Iterator cend() const {
+    ConstIterator cend() const {
+        settleAppends();
+        if (root_ == nullptr) {
+            return ConstIterator(nullptr, 0);
+        }
         auto right_most_leaf = root_->getRightMostLeaf();
         return ConstIterator(right_most_leaf,
-                             right_most_leaf->number_of_entries_);
+                             right_most_leaf->number_of_entries_,
+                             buffered_ != 0);
     }
 
     std::reverse_iterator<Iterator> rbegin() {
@@ -817,11 +5565,11 @@ class BTree {
         return std::reverse_iterator<Iterator>(begin());
     }
 
-    std::reverse_iterator<Iterator> crbegin() {
+    std::reverse_iterator<ConstIterator> crbegin() const {
         return std::reverse_iterator<ConstIterator>(cend());
     }
 
-    std::reverse_iterator<Iterator> crend() {
+    std::reverse_iterator<ConstIterator> crend() const {
         return std::reverse_iterator<ConstIterator>(cbegin());
     }
 };
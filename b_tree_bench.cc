@@ -0,0 +1,327 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "b_tree.h"
+
+// image budget of the "search flat" row when none is given, it holds
+// every internal level of a million keys at the default min degree
+constexpr long kFlatTopLevelsBytes = 4 << 20;
+
+#ifdef __linux__
+/*
+ * perf_event_attr config of read misses in the given cache
+*/
+constexpr uint64_t cacheEvent(uint64_t cache) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+#endif
+
+/*
+ * hardware counters of the calling thread read through perf_event_open,
+ * counters the kernel refuses to open (containers, virtual machines,
+ * perf_event_paranoid) are reported as unavailable
+*/
+class PerfCounters {
+  public:
+    struct Event {
+        const char *name;
+        uint32_t type;
+        uint64_t config;
+    };
+
+    static constexpr long kNumberOfEvents = 5;
+
+    PerfCounters() {
+        for (long i = 0; i < kNumberOfEvents; ++i) {
+            fds_[i] = open(kEvents[i]);
+            values_[i] = 0;
+            counted_[i] = false;
+        }
+    }
+
+    PerfCounters(const PerfCounters &other) = delete;
+    PerfCounters &operator=(const PerfCounters &other) = delete;
+
+    ~PerfCounters() {
+#ifdef __linux__
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+#endif
+    }
+
+    void start() {
+#ifdef __linux__
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    /*
+     * reads the counters, the kernel multiplexes more events than the
+     * PMU has counters, so every value is scaled from the time its event
+     * was counting to the whole time it was enabled; an event that never
+     * got a counter is reported as unavailable
+    */
+    void stop() {
+#ifdef __linux__
+        for (long i = 0; i < kNumberOfEvents; ++i) {
+            values_[i] = 0;
+            counted_[i] = false;
+            if (fds_[i] < 0) {
+                continue;
+            }
+            ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+
+            // layout of PERF_FORMAT_TOTAL_TIME_ENABLED | _RUNNING
+            struct {
+                uint64_t value;
+                uint64_t time_enabled;
+                uint64_t time_running;
+            } reading{};
+            if (read(fds_[i], &reading, sizeof(reading)) != sizeof(reading)
+                || reading.time_running == 0) {
+                continue;
+            }
+
+            double scale = static_cast<double>(reading.time_enabled)
+                / static_cast<double>(reading.time_running);
+            values_[i] = static_cast<uint64_t>(
+                static_cast<double>(reading.value) * scale);
+            counted_[i] = true;
+        }
+#endif
+    }
+
+    /*
+     * the event could be opened and was counting during the last start()
+     * and stop()
+    */
+    [[nodiscard]] bool available(long event) const {
+        return fds_[event] >= 0 && counted_[event];
+    }
+
+    /*
+     * the event could be opened, though it may not get a counter
+    */
+    [[nodiscard]] bool opened(long event) const {
+        return fds_[event] >= 0;
+    }
+
+    [[nodiscard]] uint64_t value(long event) const {
+        return values_[event];
+    }
+
+    static const char *name(long event) {
+        return kEvents[event].name;
+    }
+
+  private:
+#ifdef __linux__
+    static constexpr Event kEvents[kNumberOfEvents] = {
+        {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {"L1D-misses", PERF_TYPE_HW_CACHE,
+         cacheEvent(PERF_COUNT_HW_CACHE_L1D)},
+        {"LLC-misses", PERF_TYPE_HW_CACHE, cacheEvent(PERF_COUNT_HW_CACHE_LL)},
+        {"dTLB-misses", PERF_TYPE_HW_CACHE,
+         cacheEvent(PERF_COUNT_HW_CACHE_DTLB)},
+    };
+
+    static int open(const Event &event) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = event.type;
+        attr.config = event.config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+            | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1,
+                                        -1, 0));
+    }
+#else
+    static constexpr Event kEvents[kNumberOfEvents] = {
+        {"instructions", 0, 0},
+        {"branch-misses", 0, 0},
+        {"L1D-misses", 0, 0},
+        {"LLC-misses", 0, 0},
+        {"dTLB-misses", 0, 0},
+    };
+
+    static int open(const Event &) {
+        return -1;
+    }
+#endif
+
+    int fds_[kNumberOfEvents];
+    uint64_t values_[kNumberOfEvents];
+    bool counted_[kNumberOfEvents];
+};
+
+/*
+ * runs body, which performs operations operations, between the counters
+ * and prints wall time and counter values per operation
+*/
+template<typename Body>
+void measure(const std::string &name, size_t operations,
+             PerfCounters &counters, Body body) {
+    auto started = std::chrono::steady_clock::now();
+    counters.start();
+    body();
+    counters.stop();
+    auto elapsed = std::chrono::steady_clock::now() - started;
+
+    double per_operation = 1.0 / static_cast<double>(std::max<size_t>(
+        operations, 1));
+    std::cout << std::left << std::setw(18) << name << std::right
+              << std::fixed << std::setprecision(1) << std::setw(10)
+              << std::chrono::duration<double, std::nano>(elapsed).count()
+                  * per_operation;
+
+    for (long i = 0; i < PerfCounters::kNumberOfEvents; ++i) {
+        std::cout << std::setw(15);
+        if (counters.available(i)) {
+            std::cout << static_cast<double>(counters.value(i))
+                * per_operation;
+        } else {
+            std::cout << "n/a";
+        }
+    }
+    std::cout << std::endl;
+}
+
+/*
+ * usage: b_tree_bench [number of keys] [min degree] [flat top levels bytes]
+ * inserts, searches, iterates and removes random keys, searches and
+ * iteration are repeated after churn and after repack(), and the
+ * repacked searches once more through the flattened top levels; every
+ * row shows nanoseconds and hardware counter values per operation
+*/
+int main(int argc, char **argv) {
+    size_t number_of_keys = argc > 1 ? std::strtoul(argv[1], nullptr, 10)
+                                     : 1000000;
+    long min_degree = argc > 2 ? std::strtol(argv[2], nullptr, 10) : 32;
+    long flat_top_levels_bytes =
+        argc > 3 ? std::strtol(argv[3], nullptr, 10) : 0;
+
+    std::mt19937_64 generator(42);
+    std::vector<uint64_t> keys(number_of_keys);
+    for (auto &key : keys) {
+        key = generator();
+    }
+
+    PerfCounters counters;
+    bool any_available = false;
+    for (long i = 0; i < PerfCounters::kNumberOfEvents; ++i) {
+        any_available = any_available || counters.opened(i);
+    }
+    if (!any_available) {
+        std::cout << "hardware counters are unavailable, "
+                     "only wall time is reported\n";
+    }
+
+    std::cout << std::left << std::setw(18) << "operation" << std::right
+              << std::setw(10) << "ns";
+    for (long i = 0; i < PerfCounters::kNumberOfEvents; ++i) {
+        std::cout << std::setw(15) << PerfCounters::name(i);
+    }
+    std::cout << std::endl;
+
+    BTree<uint64_t, uint64_t> b_tree(min_degree);
+    b_tree.setFlatTopLevels(flat_top_levels_bytes);
+    measure("insert", keys.size(), counters, [&] {
+        for (auto key : keys) {
+            b_tree.insert(key, key);
+        }
+    });
+
+    std::shuffle(keys.begin(), keys.end(), generator);
+    uint64_t checksum = 0;
+    measure("search", keys.size(), counters, [&] {
+        for (auto key : keys) {
+            checksum += b_tree.search(key)->value;
+        }
+    });
+
+    measure("iterate", b_tree.size(), counters, [&] {
+        for (const auto &entry : b_tree) {
+            checksum += entry.value;
+        }
+    });
+
+    // churn: every other key is removed and replaced by a new one
+    for (size_t i = 0; i < keys.size(); i += 2) {
+        b_tree.remove(keys[i]);
+        keys[i] = generator();
+        b_tree.insert(keys[i], keys[i]);
+    }
+    std::cout << "after churn, fill factor "
+              << b_tree.stats().fill_factor << std::endl;
+    measure("search churned", keys.size(), counters, [&] {
+        for (auto key : keys) {
+            checksum += b_tree.search(key)->value;
+        }
+    });
+
+    b_tree.repack();
+    std::cout << "after repack, fill factor "
+              << b_tree.stats().fill_factor << std::endl;
+    measure("search repacked", keys.size(), counters, [&] {
+        for (auto key : keys) {
+            checksum += b_tree.search(key)->value;
+        }
+    });
+
+    // the same searches through the flattened image of the top levels,
+    // which the rows above only use if it is set on the command line
+    b_tree.setFlatTopLevels(flat_top_levels_bytes > 0 ? flat_top_levels_bytes
+                                                      : kFlatTopLevelsBytes);
+    // the first search builds the image
+    checksum += b_tree.search(keys[0])->value;
+    measure("search flat", keys.size(), counters, [&] {
+        for (auto key : keys) {
+            checksum += b_tree.search(key)->value;
+        }
+    });
+    b_tree.setFlatTopLevels(flat_top_levels_bytes);
+
+    measure("iterate repacked", b_tree.size(), counters, [&] {
+        for (const auto &entry : b_tree) {
+            checksum += entry.value;
+        }
+    });
+
+    std::shuffle(keys.begin(), keys.end(), generator);
+    measure("remove", keys.size(), counters, [&] {
+        for (auto key : keys) {
+            checksum += b_tree.remove(key);
+        }
+    });
+
+    // keeps the loops above from being optimized away
+    std::cout << "checksum " << checksum << std::endl;
+    return 0;
+}
@@ -0,0 +1,299 @@
+#ifndef B_TREE__B_TREE_CACHE_H_
+#define B_TREE__B_TREE_CACHE_H_
+
+#include <chrono>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "b_tree.h"
+
+enum class EvictionPolicy {
+    // the entry not read or written for the longest time goes first
+    kLeastRecentlyUsed,
+    // the entry closest to expiry goes first, entries without ttl last
+    kSoonestExpiry,
+    kSmallestKey,
+    kLargestKey,
+};
+
+struct CacheLimits {
+    // 0 leaves the number of entries unbounded
+    size_t max_entries = 0;
+    // bound on memoryUsage(), 0 leaves it unbounded
+    size_t max_bytes = 0;
+    // expired entries removed by every put()
+    size_t expire_per_write = 2;
+    EvictionPolicy policy = EvictionPolicy::kLeastRecentlyUsed;
+};
+
+/*
+ * ordered cache on top of BTree, entries may carry a time to live and
+ * the limits bound the number of entries and the bytes of the nodes;
+ * expiry times are kept in a second tree ordered by (expiry, key), so
+ * every put() removes a few expired entries from its front instead of
+ * sweeping the cache, and expire() runs the same bounded step on demand;
+ * an expired entry that is still stored is never returned;
+ * V must be default constructible, as the nodes of BTree default
+ * construct their entry arrays
+*/
+template<std::totally_ordered K, std::copyable V,
+    typename Clock = std::chrono::steady_clock>
+    requires std::default_initializable<V>
+class BTreeCache {
+  public:
+    using TimePoint = typename Clock::time_point;
+    using Duration = typename Clock::duration;
+
+    explicit BTreeCache(long min_degree, CacheLimits limits = CacheLimits())
+        : entries_(min_degree),
+          expiry_(min_degree),
+          recency_(min_degree),
+          limits_(limits),
+          ticks_(0),
+          expirations_(0),
+          evictions_(0) {
+        // every put() checks max_bytes, which needs memoryUsage() in O(1)
+        if (limits_.max_bytes != 0) {
+            entries_.setMemoryAccounting(true);
+            expiry_.setMemoryAccounting(true);
+            recency_.setMemoryAccounting(true);
+        }
+    }
+
+    /*
+     * stores value under key without expiry, replacing a stored value
+    */
+    void put(const K &key, V value) {
+        putUntil(key, std::move(value), kNever);
+    }
+
+    /*
+     * stores value under key until ttl from now, replacing a stored value
+    */
+    void put(const K &key, V value, Duration ttl) {
+        putUntil(key, std::move(value), Clock::now() + ttl);
+    }
+
+    /*
+     * returns the value stored under key, nullptr if there is none or it
+     * expired, the pointer is valid until the next call that changes the
+     * cache; a read only stamps the entry, the recency tree is brought up
+     * to date when the entry reaches its front
+    */
+    V *get(const K &key) {
+        Slot *slot = entries_.lookup(key);
+        if (slot == nullptr) {
+            return nullptr;
+        }
+
+        if (slot->expires_at <= Clock::now()) {
+            erase(key);
+            expirations_++;
+            return nullptr;
+        }
+
+        slot->last_used = ++ticks_;
+        return &slot->value;
+    }
+
+    /*
+     * returns number of elements removed (0 or 1)
+    */
+    int erase(const K &key) {
+        auto slot = entries_.extract(key);
+        if (!slot) {
+            return 0;
+        }
+
+        untrack(key, *slot);
+        return 1;
+    }
+
+    /*
+     * removes up to max_entries expired entries, returns number removed;
+     * the cache is not synchronized, a background caller must hold the
+     * same lock as the other users
+    */
+    size_t expire(size_t max_entries) {
+        TimePoint now = Clock::now();
+        size_t removed = 0;
+        while (removed < max_entries && expiry_.size() > 0) {
+            auto first = expiry_.begin();
+            if (first->key.first > now) {
+                break;
+            }
+
+            K key = first->key.second;
+            erase(key);
+            removed++;
+        }
+        expirations_ += removed;
+        return removed;
+    }
+
+    /*
+     * calls visit(key, value) for the entries with keys in [lo, hi)
+     * that did not expire, in key order
+    */
+    template<typename Visit>
+    void scan(const K &lo, const K &hi, Visit visit) {
+        TimePoint now = Clock::now();
+        for (auto it = entries_.lower_bound(lo);
+             it != entries_.end() && it->key < hi; ++it) {
+            if (it->value.expires_at > now) {
+                visit(it->key, it->value.value);
+            }
+        }
+    }
+
+    /*
+     * returns number of stored entries, expired ones not removed yet
+     * included
+    */
+    size_t size() {
+        return entries_.size();
+    }
+
+    /*
+     * returns bytes allocated for the nodes of the cache and its expiry
+     * and recency trees, the quantity bounded by max_bytes; memory owned
+     * by the keys and values themselves, such as the buffer of a
+     * std::string, is not known to the tree and is not included
+    */
+    size_t memoryUsage() const {
+        return entries_.memoryUsage() + expiry_.memoryUsage()
+            + recency_.memoryUsage();
+    }
+
+    size_t expirations() const {
+        return expirations_;
+    }
+
+    size_t evictions() const {
+        return evictions_;
+    }
+
+  private:
+    static constexpr TimePoint kNever = TimePoint::max();
+
+    struct Slot {
+        V value;
+        TimePoint expires_at;
+        // tick of the last read or write, kept for kLeastRecentlyUsed
+        uint64_t last_used;
+        // tick the key is stored under in the recency tree, older than
+        // last_used once the entry was read
+        uint64_t tracked_at;
+    };
+
+    void putUntil(const K &key, V value, TimePoint expires_at) {
+        expire(limits_.expire_per_write);
+
+        uint64_t tick = ++ticks_;
+        // the slot is built from value only if the key is new
+        auto [it, inserted] = entries_.try_emplace(key, std::move(value),
+                                                   expires_at, tick, tick);
+        if (!inserted) {
+            untrack(key, it->value);
+            it->value.value = std::move(value);
+            it->value.expires_at = expires_at;
+            it->value.last_used = tick;
+        }
+        track(key, it->value);
+
+        while (overLimits()) {
+            evictOne();
+        }
+    }
+
+    /*
+     * removes an expired entry if there is one, else the policy's victim
+    */
+    void evictOne() {
+        if (expire(1) == 0) {
+            erase(victim());
+            evictions_++;
+        }
+    }
+
+    void track(const K &key, Slot &slot) {
+        if (slot.expires_at != kNever) {
+            expiry_.insert({slot.expires_at, key}, 0);
+        }
+        if (limits_.policy == EvictionPolicy::kLeastRecentlyUsed) {
+            slot.tracked_at = slot.last_used;
+            recency_.insert({slot.tracked_at, key}, 0);
+        }
+    }
+
+    void untrack(const K &key, const Slot &slot) {
+        if (slot.expires_at != kNever) {
+            expiry_.remove({slot.expires_at, key});
+        }
+        if (limits_.policy == EvictionPolicy::kLeastRecentlyUsed) {
+            recency_.remove({slot.tracked_at, key});
+        }
+    }
+
+    bool overLimits() {
+        if (entries_.size() == 0) {
+            return false;
+        }
+        return (limits_.max_entries != 0
+            && entries_.size() > limits_.max_entries)
+            || (limits_.max_bytes != 0
+                && memoryUsage() > limits_.max_bytes);
+    }
+
+    /*
+     * returns key of the entry the policy evicts next
+    */
+    K victim() {
+        switch (limits_.policy) {
+            case EvictionPolicy::kLeastRecentlyUsed:
+                return leastRecentlyUsed();
+            case EvictionPolicy::kSoonestExpiry:
+                if (expiry_.size() > 0) {
+                    return expiry_.begin()->key.second;
+                }
+                return entries_.begin()->key;
+            case EvictionPolicy::kSmallestKey:
+                return entries_.begin()->key;
+            case EvictionPolicy::kLargestKey:
+                return (*entries_.rbegin()).key;
+        }
+        return entries_.begin()->key;
+    }
+
+    /*
+     * entries read since they were tracked are moved from the front of
+     * the recency tree to their last read, until the front entry was not
+     * used after the tick it is stored under; every read moves an entry
+     * at most once
+    */
+    K leastRecentlyUsed() {
+        while (true) {
+            auto [tracked_at, key] = recency_.begin()->key;
+            Slot *slot = entries_.lookup(key);
+            if (slot->last_used == tracked_at) {
+                return key;
+            }
+
+            recency_.remove({tracked_at, key});
+            slot->tracked_at = slot->last_used;
+            recency_.insert({slot->tracked_at, key}, 0);
+        }
+    }
+
+    BTree<K, Slot> entries_;
+    BTree<std::pair<TimePoint, K>, char> expiry_;
+    BTree<std::pair<uint64_t, K>, char> recency_;
+    CacheLimits limits_;
+    uint64_t ticks_;
+    size_t expirations_;
+    size_t evictions_;
+};
+
+#endif
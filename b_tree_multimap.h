@@ -0,0 +1,86 @@
+#ifndef B_TREE__B_TREE_MULTIMAP_H_
+#define B_TREE__B_TREE_MULTIMAP_H_
+
+#include <concepts>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "b_tree.h"
+
+/*
+ * multimap on top of BTree that keeps all values of a key in one entry
+*/
+template<std::totally_ordered K, std::copyable V>
+class BTreeMultimap {
+  public:
+    using Values = std::vector<V>;
+
+    explicit BTreeMultimap(long min_degree) : groups_(min_degree), size_(0) {
+    }
+
+    void insert(K key, V value) {
+        groups_.try_emplace(std::move(key)).first->value.push_back(
+            std::move(value));
+        size_++;
+    }
+
+    /*
+     * returns range of the values stored under key in insertion order
+    */
+    std::pair<typename Values::const_iterator,
+              typename Values::const_iterator> equal_range(K key) {
+        static const Values kNoValues;
+
+        auto it = groups_.search(key);
+        if (it == groups_.end()) {
+            return {kNoValues.cbegin(), kNoValues.cend()};
+        }
+        return {it->value.cbegin(), it->value.cend()};
+    }
+
+    size_t count(K key) {
+        auto it = groups_.search(key);
+        return it == groups_.end() ? 0 : it->value.size();
+    }
+
+    /*
+     * removes all values of key, returns number of values removed
+    */
+    size_t remove(K key) {
+        auto values = groups_.extract(std::move(key));
+        if (!values) {
+            return 0;
+        }
+
+        size_ -= values->size();
+        return values->size();
+    }
+
+    /*
+     * returns number of stored values
+    */
+    size_t size() const {
+        return size_;
+    }
+
+    /*
+     * returns number of distinct keys
+    */
+    size_t keyCount() const {
+        return groups_.size();
+    }
+
+    /*
+     * the underlying tree, each entry holds all values of one key
+    */
+    BTree<K, Values> &groups() {
+        return groups_;
+    }
+
+  private:
+    BTree<K, Values> groups_;
+    size_t size_;
+};
+
+#endif
@@ -1,8 +1,14 @@
 #include <gtest/gtest.h>
 
+#include <chrono>
+#include <optional>
 #include <ranges>
+#include <set>
 #include <utility>
 #include "b_tree.h"
+#include "b_tree_cache.h"
+#include "b_tree_multimap.h"
+#include "normalized_key.h"
 
 TEST(BTreeTests, InsertTest) {
     BTree<int, char> b_tree(3);
@@ -141,3 +147,1001 @@ TEST(BTreeTests, FindIfTest) {
     EXPECT_EQ(90, it->value.n);
     EXPECT_EQ("test", it->value.s);
 }
+
+TEST(BTreeTests, OrderStatisticsTest) {
+    BTree<int, int> b_tree(3);
+    EXPECT_EQ(b_tree.cbegin(), b_tree.cend());
+    EXPECT_EQ(b_tree.end() + 3, b_tree.end());
+    EXPECT_EQ(b_tree.end() - b_tree.begin(), 0);
+
+    for (int i = 0; i < 500; i++) {
+        int key = (i * 37) % 500;
+        b_tree.insert(key, -key);
+    }
+
+    EXPECT_THROW(b_tree.rank(0), std::logic_error);
+    EXPECT_THROW(b_tree.select(0), std::logic_error);
+    auto walked = b_tree.begin() + 100;
+    EXPECT_EQ(walked->key, 100);
+    EXPECT_EQ(walked - b_tree.begin(), 100);
+    EXPECT_EQ((walked - 1000)->key, 0);
+
+    b_tree.setOrderStatistics(true);
+    EXPECT_EQ(b_tree.rank(0), 0);
+    EXPECT_EQ(b_tree.rank(250), 250);
+    EXPECT_EQ(b_tree.rank(1000), 500);
+    EXPECT_EQ(b_tree.countRange(100, 200), 100);
+    EXPECT_EQ(b_tree.countRange(200, 100), 0);
+
+    for (int i = 0; i < 500; i += 7) {
+        EXPECT_EQ(b_tree.select(i)->key, i);
+    }
+    EXPECT_EQ(b_tree.select(500), b_tree.end());
+
+    for (int i = 0; i < 500; i += 2) {
+        b_tree.remove(i);
+    }
+
+    EXPECT_EQ(b_tree.rank(100), 50);
+    EXPECT_EQ(b_tree.countRange(0, 500), 250);
+    EXPECT_EQ(b_tree.select(10)->key, 21);
+
+    auto it = b_tree.begin();
+    it += 100;
+    EXPECT_EQ(it->key, 201);
+    it -= 50;
+    EXPECT_EQ(it->key, 101);
+    EXPECT_EQ(it - b_tree.begin(), 50);
+    EXPECT_EQ(b_tree.end() - b_tree.begin(), 250);
+    EXPECT_EQ(it + 1000, b_tree.end());
+}
+
+// the first value in key order, combine depends on the order
+struct FirstAggregate {
+    using value_type = std::optional<int>;
+
+    static value_type identity() {
+        return std::nullopt;
+    }
+
+    static value_type lift(int value) {
+        return value;
+    }
+
+    static value_type combine(const value_type &a, const value_type &b) {
+        return a ? a : b;
+    }
+};
+
+template<typename Tree>
+concept WriteBufferable = requires(Tree &tree) {
+    tree.setWriteBuffer(64);
+};
+
+TEST(BTreeTests, AggregateTest) {
+    BTree<int, long, SumAggregate<long>> sums(3);
+    BTree<int, int, MaxAggregate<int>> maxima(4);
+    for (int i = 0; i < 300; i++) {
+        int key = (i * 71) % 300;
+        sums.insert(key, key);
+        maxima.insert(key, (key * 13) % 101);
+    }
+
+    EXPECT_EQ(sums.reduce(), 299 * 300 / 2);
+    EXPECT_EQ(sums.reduce(10, 20), 145);
+    EXPECT_EQ(sums.reduce(20, 10), 0);
+    EXPECT_EQ(maxima.reduce(0, 7), 78);
+
+    for (int i = 0; i < 300; i += 3) {
+        sums.remove(i);
+    }
+
+    EXPECT_EQ(sums.reduce(10, 20), 145 - 12 - 15 - 18);
+    EXPECT_EQ(sums.reduce(0, 300), 299 * 300 / 2 - 99 * 100 / 2 * 3);
+
+    BTree<int, int, FirstAggregate> firsts(3);
+    for (int i = 0; i < 100; i++) {
+        firsts.insert((i * 37) % 100, i);
+    }
+    EXPECT_EQ(firsts.reduce(), 0);
+    EXPECT_EQ(firsts.reduce(1, 100), 73);
+
+    // buffered values are combined out of key order
+    static_assert(WriteBufferable<BTree<int, int, SumAggregate<int>>>);
+    static_assert(!WriteBufferable<BTree<int, int, FirstAggregate>>);
+}
+
+TEST(BTreeTests, LazyDeletionTest) {
+    BTree<int, int, SumAggregate<int>> b_tree(3);
+    b_tree.setOrderStatistics(true);
+    b_tree.setLazyDeletion(true, 0.5);
+    for (int i = 0; i < 100; i++) {
+        b_tree.insert(i, 1);
+    }
+
+    for (int i = 0; i < 100; i += 4) {
+        EXPECT_EQ(b_tree.remove(i), 1);
+    }
+    EXPECT_EQ(b_tree.remove(0), 0);
+
+    EXPECT_EQ(b_tree.size(), 75);
+    EXPECT_EQ(b_tree.tombstones(), 25);
+    EXPECT_EQ(b_tree.search(8), b_tree.end());
+    EXPECT_EQ(b_tree.search(9)->key, 9);
+    EXPECT_EQ(b_tree.rank(10), 7);
+    EXPECT_EQ(b_tree.select(3)->key, 5);
+    EXPECT_EQ(b_tree.reduce(0, 100), 75);
+
+    int expected = 1;
+    for (auto e : b_tree) {
+        EXPECT_EQ(expected, e.key);
+        expected += expected % 4 == 3 ? 2 : 1;
+    }
+    EXPECT_EQ(expected, 101);
+    EXPECT_EQ((--b_tree.end())->key, 99);
+
+    for (int i = 1; i < 100; i += 4) {
+        b_tree.remove(i);
+    }
+    // the subtrees that went over the ratio were rebuilt on their own
+    EXPECT_GT(b_tree.tombstones(), 0);
+    EXPECT_LT(b_tree.tombstones(), 50);
+    EXPECT_EQ(b_tree.size(), 50);
+    EXPECT_EQ(b_tree.select(0)->key, 2);
+    EXPECT_EQ(b_tree.rank(50), 24);
+    EXPECT_EQ(b_tree.reduce(), 50);
+
+    b_tree.remove(2);
+    b_tree.setLazyDeletion(false);
+    EXPECT_EQ(b_tree.tombstones(), 0);
+    EXPECT_EQ(b_tree.begin()->key, 3);
+
+    // emptying one region rebuilds it and leaves the erased entries
+    // spread over the rest of the tree in place
+    BTree<int, int, SumAggregate<int>> spread(3);
+    spread.setHashIndex(true);
+    spread.setLazyDeletion(true, 0.5);
+    for (int i = 0; i < 1000; i++) {
+        spread.insert((i * 389) % 1000, 1);
+    }
+    for (int i = 0; i < 1000; i += 4) {
+        spread.remove(i);
+    }
+    size_t scattered = spread.tombstones();
+    for (int i = 0; i < 200; i++) {
+        spread.remove(i);
+    }
+    EXPECT_EQ(spread.size(), 600);
+    EXPECT_GE(spread.tombstones(), scattered / 4);
+    EXPECT_LT(spread.tombstones(), scattered + 150);
+    EXPECT_EQ(spread.reduce(), 600);
+    EXPECT_EQ(spread.search(150), spread.end());
+    EXPECT_EQ(spread.lookup(199), nullptr);
+    EXPECT_EQ(*spread.lookup(202), 1);
+    EXPECT_EQ(spread.search(201)->key, 201);
+    EXPECT_EQ(spread.begin()->key, 201);
+
+    int live = 201;
+    for (auto e : spread) {
+        EXPECT_EQ(live, e.key);
+        live += live % 4 == 3 ? 2 : 1;
+    }
+    EXPECT_EQ(live, 1001);
+}
+
+TEST(BTreeTests, WriteBufferTest) {
+    BTree<int, int, SumAggregate<int>> b_tree(3);
+    b_tree.setOrderStatistics(true);
+    b_tree.setWriteBuffer(64);
+    for (int i = 0; i < 1000; i++) {
+        b_tree.insert((i * 389) % 1000, 1);
+    }
+    EXPECT_EQ(b_tree.size(), 1000);
+
+    EXPECT_EQ(b_tree.remove(5), 1);
+    EXPECT_EQ(b_tree.remove(5), 0);
+    b_tree.insert(5, 2);
+    EXPECT_EQ(b_tree.remove(7), 1);
+    EXPECT_EQ(b_tree.remove(1000), 0);
+    EXPECT_EQ(b_tree.size(), 999);
+
+    EXPECT_EQ(b_tree.search(7), b_tree.end());
+    EXPECT_EQ(b_tree.search(5)->value, 2);
+    EXPECT_EQ(b_tree.reduce(), 1000);
+
+    b_tree.insert(2000, 1);
+    EXPECT_EQ(b_tree.rank(2000), 999);
+
+    // const reads count buffered inserts and leave them in the buffers
+    const auto &view = b_tree;
+    EXPECT_EQ(view.countRange(0, 3000), 1000);
+    EXPECT_EQ(view.reduce(0, 10), 10);
+    EXPECT_EQ(b_tree.count(2000), 1);
+    EXPECT_NE(b_tree.lookup(2000), nullptr);
+    EXPECT_LT(b_tree.stats().entries, b_tree.size() + b_tree.tombstones());
+
+    int previous = -1;
+    for (auto e : b_tree) {
+        EXPECT_LT(previous, e.key);
+        previous = e.key;
+    }
+
+    b_tree.remove(2000);
+    b_tree.setWriteBuffer(0);
+    EXPECT_EQ(b_tree.size(), 999);
+    EXPECT_EQ((--b_tree.end())->key, 999);
+
+    // iterators walk the buffered inserts with the stored entries
+    BTree<int, int> buffered(3);
+    buffered.setOrderStatistics(true);
+    buffered.setWriteBuffer(64);
+    for (int i = 0; i < 200; i++) {
+        buffered.insert((i * 37) % 200, 0);
+    }
+    auto first = buffered.search(0);
+    long visited = 0;
+    for (auto it = first; it != buffered.end(); ++it) {
+        EXPECT_EQ(it->key, visited);
+        EXPECT_EQ((first + visited)->key, it->key);
+        EXPECT_EQ(it - first, visited);
+        visited++;
+    }
+    EXPECT_EQ(visited, 200);
+    EXPECT_EQ(first + visited, buffered.end());
+    EXPECT_EQ((buffered.end() - 1)->key, 199);
+    EXPECT_EQ(buffered.lower_bound(150)->key, 150);
+    EXPECT_EQ(buffered.upper_bound(150)->key, 151);
+    EXPECT_EQ(buffered.rank(150), 150);
+    EXPECT_EQ((buffered.begin() + 150)->key, 150);
+    EXPECT_EQ(buffered.end() - buffered.begin(), 200);
+    EXPECT_EQ(buffered.select(150)->key, 150);
+
+    // const iteration leaves the inserts in the buffers
+    BTree<int, int> unflushed(3);
+    unflushed.setWriteBuffer(64);
+    for (int i = 0; i < 200; i++) {
+        unflushed.insert((i * 37) % 200, 0);
+    }
+    const auto &const_view = unflushed;
+    EXPECT_EQ(std::distance(const_view.cbegin(), const_view.cend()), 200);
+    unflushed.insert(500, 0);
+    unflushed.insert(300, 0);
+    EXPECT_EQ(const_view.crbegin()->key, 500);
+    EXPECT_EQ(std::distance(const_view.crbegin(), const_view.crend()), 202);
+    EXPECT_LT(unflushed.stats().entries, unflushed.size());
+
+    // an upsert of a buffered key past all stored keys appends it first
+    BTree<int, long> appended(3);
+    appended.setWriteBuffer(64);
+    for (int i = 0; i < 20; i++) {
+        appended.insert(i, 1);
+    }
+    appended.insert(1000, 1);
+    EXPECT_FALSE(appended.upsert(1000, [](long &v) { v++; }).second);
+    EXPECT_EQ(*appended.lookup(1000), 2);
+    EXPECT_EQ(appended.size(), 21);
+}
+
+TEST(BTreeTests, BufferedRemoveTest) {
+    BTree<int, int> b_tree(3);
+    b_tree.setOrderStatistics(true);
+    b_tree.setWriteBuffer(16);
+    for (int i = 0; i < 300; i++) {
+        b_tree.insert(i % 100, i);
+    }
+    b_tree.flush();
+
+    // a remove takes the last entry with its key, the older one of two
+    // buffered removes the last one
+    EXPECT_EQ(b_tree.remove(10), 1);
+    EXPECT_EQ(b_tree.extract(10), 110);
+    EXPECT_EQ(b_tree.stats().entries, 300);
+    EXPECT_EQ(b_tree.tombstones(), 0);
+    EXPECT_EQ(b_tree.count(10), 1);
+    EXPECT_EQ(*b_tree.lookup(10), 10);
+    EXPECT_EQ(b_tree.extract(10), 10);
+    EXPECT_EQ(b_tree.remove(10), 0);
+    EXPECT_EQ(b_tree.lookup(10), nullptr);
+    EXPECT_FALSE(b_tree.modify(10, [](int &v) { v++; }));
+    EXPECT_EQ(b_tree.size(), 297);
+
+    for (int i = 0; i < 100; i++) {
+        b_tree.remove(i);
+    }
+    b_tree.insert(20, -1);
+    EXPECT_EQ(b_tree.count(20), 3);
+    EXPECT_EQ(b_tree.size(), 199);
+
+    // iteration skips the entries the buffered removes take
+    long visited = 0;
+    int previous = -1;
+    for (auto it = b_tree.begin(); it != b_tree.end(); ++it) {
+        EXPECT_NE(it->key, 10);
+        EXPECT_LE(previous, it->key);
+        EXPECT_LT(it->value, 200);
+        EXPECT_EQ(it - b_tree.begin(), visited);
+        EXPECT_EQ(b_tree.begin() + visited, it);
+        previous = it->key;
+        visited++;
+    }
+    EXPECT_EQ(visited, 199);
+    EXPECT_EQ(b_tree.rank(50), 99);
+    EXPECT_EQ(b_tree.lower_bound(10)->key, 11);
+    EXPECT_EQ(b_tree.upper_bound(20)->key, 21);
+
+    b_tree.setWriteBuffer(0);
+    EXPECT_EQ(b_tree.size(), 199);
+    EXPECT_EQ(b_tree.count(20), 3);
+    EXPECT_EQ(b_tree.search(10), b_tree.end());
+    EXPECT_EQ(std::distance(b_tree.begin(), b_tree.end()), 199);
+}
+
+TEST(BTreeTests, UniqueInsertTest) {
+    BTree<int, std::string> b_tree(3);
+    for (int i = 0; i < 100; i++) {
+        EXPECT_TRUE(b_tree.try_emplace(i * 7 % 100, 3, 'a').second);
+        EXPECT_EQ(b_tree.try_emplace(i * 7 % 100, "b").first->value, "aaa");
+    }
+
+    auto [it, inserted] = b_tree.insert_or_assign(4, "d");
+    EXPECT_FALSE(inserted);
+    EXPECT_EQ(it->key, 4);
+    EXPECT_EQ(b_tree.search(4)->value, "d");
+
+    EXPECT_TRUE(b_tree.insert_or_assign(100, "e").second);
+    EXPECT_EQ(b_tree.size(), 101);
+    EXPECT_EQ(b_tree.count(100), 1);
+    EXPECT_EQ(b_tree.count(101), 0);
+
+    b_tree.setLazyDeletion(true);
+    b_tree.remove(6);
+    EXPECT_TRUE(b_tree.try_emplace(6, "f").second);
+    EXPECT_EQ(b_tree.tombstones(), 0);
+    EXPECT_EQ(b_tree.search(6)->value, "f");
+}
+
+TEST(BTreeTests, EqualRangeTest) {
+    BTree<int, int> b_tree(3);
+    for (int i = 0; i < 300; i++) {
+        b_tree.insert(i % 30, i);
+    }
+
+    auto [first, last] = b_tree.equal_range(7);
+    int values = 0;
+    for (auto it = first; it != last; ++it) {
+        EXPECT_EQ(it->key, 7);
+        EXPECT_EQ(it->value % 30, 7);
+        values++;
+    }
+    EXPECT_EQ(values, 10);
+    EXPECT_EQ(b_tree.count(7), 10);
+    EXPECT_EQ(b_tree.lower_bound(30), b_tree.end());
+    EXPECT_EQ(b_tree.upper_bound(28)->key, 29);
+
+    // every remove of a key with many copies takes out exactly one copy
+    for (int round = 0; round < 5; round++) {
+        for (int key = 0; key < 30; key += 3) {
+            EXPECT_EQ(b_tree.remove(key), 1);
+        }
+    }
+    std::multiset<int> remaining;
+    for (auto e : b_tree) {
+        EXPECT_EQ(e.value % 30, e.key);
+        remaining.insert(e.value);
+    }
+    EXPECT_EQ(remaining.size(), 250);
+    for (int value : remaining) {
+        EXPECT_EQ(remaining.count(value), 1);
+    }
+    EXPECT_EQ(b_tree.count(3), 5);
+
+    // extract() returns the copy it removed, the others stay
+    for (bool lazy : {false, true}) {
+        BTree<int, int> copies(3);
+        copies.setLazyDeletion(lazy);
+        for (int i = 0; i < 200; i++) {
+            copies.insert(i % 4, i);
+        }
+        std::multiset<int> values;
+        for (int i = 1; i < 200; i += 4) {
+            values.insert(i);
+        }
+        for (int round = 0; round < 30; round++) {
+            auto value = copies.extract(1);
+            ASSERT_TRUE(value.has_value());
+            EXPECT_EQ(values.erase(*value), 1);
+
+            std::multiset<int> stored;
+            auto [from, to] = copies.equal_range(1);
+            for (auto it = from; it != to; ++it) {
+                stored.insert(it->value);
+            }
+            EXPECT_EQ(stored, values);
+        }
+        EXPECT_EQ(copies.size(), 170);
+    }
+
+    BTreeMultimap<std::string, int> multimap(3);
+    for (int i = 0; i < 1000; i++) {
+        multimap.insert(i % 10 == 0 ? "cold" : "hot", i);
+    }
+    EXPECT_EQ(multimap.size(), 1000);
+    EXPECT_EQ(multimap.keyCount(), 2);
+    EXPECT_EQ(multimap.count("hot"), 900);
+
+    auto [value, values_end] = multimap.equal_range("cold");
+    EXPECT_EQ(values_end - value, 100);
+    EXPECT_EQ(*value, 0);
+    EXPECT_EQ(*++value, 10);
+
+    EXPECT_EQ(multimap.remove("hot"), 900);
+    EXPECT_EQ(multimap.size(), 100);
+    EXPECT_EQ(multimap.count("hot"), 0);
+    EXPECT_EQ(multimap.remove("hot"), 0);
+    EXPECT_EQ(multimap.keyCount(), 1);
+}
+
+TEST(BTreeTests, UpsertTest) {
+    BTree<std::string, int, SumAggregate<int>> counters(3);
+    const std::string words[] = {"b", "a", "c", "a", "b", "a", "d"};
+    for (int round = 0; round < 10; round++) {
+        for (const auto &word : words) {
+            counters.upsert(word + std::to_string(round % 3),
+                            [](int &count) { count++; });
+        }
+    }
+
+    EXPECT_EQ(counters.size(), 12);
+    EXPECT_EQ(counters.search("a0")->value, 12);
+    EXPECT_EQ(counters.search("d1")->value, 3);
+    EXPECT_EQ(counters.reduce(), 70);
+    EXPECT_EQ(counters.reduce("a", "b"), 30);
+
+    EXPECT_TRUE(counters.modify("a0", [](int &count) { count = 0; }));
+    EXPECT_FALSE(counters.modify("e0", [](int &count) { count = 0; }));
+    EXPECT_EQ(counters.size(), 12);
+    EXPECT_EQ(counters.reduce("a", "b"), 18);
+
+    auto [it, inserted] = counters.upsert("e0", [](int &count) {
+        count += 5;
+    });
+    EXPECT_TRUE(inserted);
+    EXPECT_EQ(it->value, 5);
+    EXPECT_EQ(counters.reduce(), 63);
+}
+
+TEST(BTreeTests, HintTest) {
+    BTree<int, int, SumAggregate<int>> b_tree(3);
+    b_tree.setOrderStatistics(true);
+    auto hint = b_tree.end();
+    for (int i = 0; i < 500; i++) {
+        hint = b_tree.insert(hint, i * 2, 1);
+        EXPECT_EQ(hint->key, i * 2);
+    }
+    EXPECT_EQ(b_tree.size(), 500);
+    EXPECT_EQ(b_tree.reduce(), 500);
+
+    hint = b_tree.search(500);
+    hint = b_tree.insert(hint, 501, 1);
+    EXPECT_EQ(hint->key, 501);
+    EXPECT_EQ((++hint)->key, 502);
+    EXPECT_EQ(b_tree.rank(502), 252);
+
+    hint = b_tree.begin();
+    for (int i = 0; i < 1000; i += 3) {
+        auto found = b_tree.search(hint, i);
+        if (i % 2 == 0 || i == 501) {
+            ASSERT_NE(found, b_tree.end());
+            EXPECT_EQ(found->key, i);
+            hint = found;
+        } else {
+            EXPECT_EQ(found, b_tree.end());
+        }
+    }
+    EXPECT_EQ(b_tree.search(b_tree.end(), 0)->key, 0);
+    EXPECT_EQ(b_tree.search(b_tree.begin(), 998)->key, 998);
+
+    int previous = -1;
+    for (auto e : b_tree) {
+        EXPECT_LT(previous, e.key);
+        previous = e.key;
+    }
+}
+
+TEST(BTreeTests, AppendTest) {
+    BTree<long, long, SumAggregate<long>> b_tree(8);
+    b_tree.setOrderStatistics(true);
+    for (long i = 0; i < 10000; i++) {
+        b_tree.insert(i, i);
+    }
+
+    EXPECT_EQ(b_tree.size(), 10000);
+    EXPECT_GT(b_tree.stats().fill_factor, 0.9);
+    EXPECT_EQ(b_tree.reduce(), 9999L * 10000 / 2);
+    EXPECT_EQ(b_tree.select(1234)->key, 1234);
+    EXPECT_EQ(b_tree.rank(5000), 5000);
+
+    long expected = 0;
+    for (auto e : b_tree) {
+        EXPECT_EQ(expected, e.key);
+        expected++;
+    }
+    EXPECT_EQ(expected, 10000);
+
+    b_tree.insert(5000, 0);
+    for (long i = 0; i < 10000; i += 2) {
+        EXPECT_EQ(b_tree.remove(i), 1);
+    }
+    EXPECT_EQ(b_tree.size(), 5001);
+    EXPECT_EQ(b_tree.search(5000)->value, 0);
+    EXPECT_EQ(b_tree.select(0)->key, 1);
+    EXPECT_EQ((--b_tree.end())->key, 9999);
+
+    for (long i = 10000; i < 10100; i++) {
+        b_tree.insert(i, 1);
+    }
+    EXPECT_EQ(b_tree.cend() - b_tree.cbegin(), 5101);
+    EXPECT_EQ(b_tree.rank(10050), 5051);
+    EXPECT_EQ(b_tree.reduce(10000, 10100), 100);
+
+    // iterators handed out right after appends see the appended counts
+    BTree<long, long> appended(3);
+    appended.setOrderStatistics(true);
+    for (long i = 0; i < 10; i++) {
+        appended.insert(i * 10, 0);
+    }
+    for (long i = 100; i < 120; i++) {
+        appended.insert(i, 0);
+    }
+    EXPECT_EQ((appended.search(0) + 25)->key, 115);
+    appended.insert(120, 0);
+    auto first = appended.search(appended.search(0), 0);
+    EXPECT_EQ(appended.search(120) - first, 30);
+}
+
+TEST(BTreeTests, SplitJoinTest) {
+    using Tree = BTree<int, int, SumAggregate<int>>;
+    Tree b_tree(3);
+    b_tree.setOrderStatistics(true);
+    for (int i = 0; i < 1000; i++) {
+        b_tree.insert((i * 37) % 1000, 1);
+    }
+
+    auto [left, right] = b_tree.splitAt(400);
+    EXPECT_EQ(b_tree.size(), 0);
+    EXPECT_EQ(left.size(), 400);
+    EXPECT_EQ(right.size(), 600);
+    EXPECT_EQ(left.reduce(), 400);
+    EXPECT_EQ((--left.end())->key, 399);
+    EXPECT_EQ(right.begin()->key, 400);
+    EXPECT_EQ(right.select(100)->key, 500);
+
+    // without order statistics the parts are counted, join sets them up
+    right.setOrderStatistics(false);
+    auto [small, rest] = right.splitAt(405);
+    EXPECT_EQ(small.size(), 5);
+    EXPECT_EQ(rest.size(), 595);
+    EXPECT_THROW(Tree::join(std::move(rest), std::move(left)),
+                 std::invalid_argument);
+
+    auto joined = Tree::join(std::move(left), std::move(rest));
+    EXPECT_EQ(joined.size(), 995);
+    EXPECT_EQ(joined.reduce(), 995);
+    EXPECT_EQ(joined.search(402), joined.end());
+    EXPECT_EQ(joined.rank(410), 405);
+
+    int expected = 0;
+    for (auto e : joined) {
+        if (expected == 400) {
+            expected = 405;
+        }
+        EXPECT_EQ(expected, e.key);
+        expected++;
+    }
+    EXPECT_EQ(expected, 1000);
+
+    joined = Tree::join(std::move(joined), std::move(b_tree));
+    EXPECT_EQ(joined.size(), 995);
+    auto [all, none] = joined.splitAt(2000);
+    EXPECT_EQ(all.size(), 995);
+    EXPECT_EQ(none.size(), 0);
+    EXPECT_EQ(none.begin(), none.end());
+}
+
+TEST(BTreeTests, JoinAppendedTest) {
+    using Tree = BTree<int, int, SumAggregate<int>>;
+    Tree joined(3);
+    for (int chunk = 0; chunk < 40; chunk++) {
+        Tree appended(3);
+        for (int i = 0; i < 50 + chunk * 7; i++) {
+            appended.insert(chunk * 1000 + i, 1);
+        }
+        joined = Tree::join(std::move(joined), std::move(appended));
+        EXPECT_EQ(joined.stats().underfull_nodes, 0);
+    }
+    size_t size = joined.size();
+
+    auto [left, right] = joined.splitAt(20500);
+    EXPECT_EQ(left.stats().underfull_nodes, 0);
+    EXPECT_EQ(right.stats().underfull_nodes, 0);
+    EXPECT_EQ(left.size() + right.size(), size);
+    EXPECT_EQ(left.reduce() + right.reduce(), static_cast<int>(size));
+
+    int previous = -1;
+    for (auto e : Tree::join(std::move(left), std::move(right))) {
+        EXPECT_LT(previous, e.key);
+        previous = e.key;
+    }
+}
+
+TEST(BTreeTests, SetOperationsTest) {
+    BTree<int, int> evens(3);
+    BTree<int, int> thirds(4);
+    for (int i = 0; i < 600; i++) {
+        if (i % 2 == 0) {
+            evens.insert(i, 2);
+        }
+        if (i % 3 == 0) {
+            thirds.insert(i, 3);
+        }
+    }
+
+    auto united = evens.unionWith(thirds);
+    EXPECT_EQ(united.size(), 400);
+    EXPECT_EQ(united.search(6)->value, 2);
+    EXPECT_EQ(united.search(9)->value, 3);
+    EXPECT_EQ(united.search(1), united.end());
+
+    auto both = evens.intersect(thirds);
+    EXPECT_EQ(both.size(), 100);
+    int expected = 0;
+    for (auto e : both) {
+        EXPECT_EQ(expected, e.key);
+        EXPECT_EQ(e.value, 2);
+        expected += 6;
+    }
+
+    auto only_evens = evens.difference(thirds);
+    EXPECT_EQ(only_evens.size(), 200);
+    EXPECT_EQ(only_evens.search(6), only_evens.end());
+    EXPECT_EQ(only_evens.search(4)->value, 2);
+
+    BTree<int, int> few(3);
+    few.insert(-1, 0);
+    few.insert(300, 0);
+    few.insert(301, 0);
+    few.insert(598, 0);
+    few.insert(598, 1);
+    few.insert(1000, 0);
+    EXPECT_EQ(evens.intersect(few).size(), 2);
+    EXPECT_EQ(few.intersect(evens).size(), 3);
+    EXPECT_EQ(few.difference(evens).size(), 3);
+    EXPECT_EQ(few.difference(evens).begin()->key, -1);
+    EXPECT_EQ(evens.size(), 300);
+    EXPECT_EQ(few.size(), 6);
+}
+
+TEST(BTreeTests, ExtremeKeysTest) {
+    BTree<int64_t, int> b_tree(4);
+    for (int64_t i = 0; i < 1000; i++) {
+        b_tree.insert(i * 5 - 2000, 0);
+    }
+
+    b_tree.insert(std::numeric_limits<int64_t>::min(), 1);
+    b_tree.insert(std::numeric_limits<int64_t>::max(), 2);
+    EXPECT_EQ(b_tree.begin()->value, 1);
+    EXPECT_EQ((--b_tree.end())->value, 2);
+
+    EXPECT_EQ(b_tree.lower_bound(-1998)->key, -1995);
+    EXPECT_EQ(b_tree.upper_bound(-1995)->key, -1990);
+    EXPECT_EQ(b_tree.lower_bound(2996)->key, std::numeric_limits<int64_t>::max());
+    EXPECT_EQ(b_tree.search(2995)->key, 2995);
+    EXPECT_EQ(b_tree.search(2994), b_tree.end());
+    EXPECT_EQ(b_tree.remove(-2000), 1);
+    EXPECT_EQ(b_tree.search(-2000), b_tree.end());
+    EXPECT_EQ(b_tree.search(-1995)->key, -1995);
+
+    auto copy = b_tree;
+    EXPECT_EQ(copy.search(std::numeric_limits<int64_t>::min())->value, 1);
+}
+
+TEST(BTreeTests, HashIndexTest) {
+    BTree<int, int> b_tree(3);
+    for (int i = 0; i < 1000; i++) {
+        b_tree.insert((i * 7) % 1000, i);
+    }
+    EXPECT_EQ(b_tree.stats().hash_index_keys, 0);
+
+    b_tree.setHashIndex(true);
+    EXPECT_EQ(b_tree.stats().hash_index_keys, 1000);
+    EXPECT_GT(b_tree.stats().hash_index_bytes, 0);
+    EXPECT_LE(b_tree.stats().hash_index_bytes_per_key, 32);
+    size_t updates = b_tree.stats().hash_index_updates;
+
+    for (int i = 0; i < 1000; i += 2) {
+        EXPECT_EQ(b_tree.remove(i), 1);
+    }
+    for (int i = 1000; i < 1500; i++) {
+        b_tree.insert(i, i);
+    }
+    EXPECT_EQ(b_tree.stats().hash_index_keys, 1000);
+    EXPECT_GT(b_tree.stats().hash_index_updates, updates);
+
+    for (int i = 0; i < 1500; i++) {
+        auto found = b_tree.search(i);
+        if (i < 1000 && i % 2 == 0) {
+            EXPECT_EQ(found, b_tree.end());
+        } else {
+            ASSERT_NE(found, b_tree.end());
+            EXPECT_EQ(found->key, i);
+        }
+    }
+
+    for (int i = 0; i < 3; i++) {
+        b_tree.insert(3, i);
+    }
+    for (int i = 0; i < 4; i++) {
+        EXPECT_EQ(b_tree.remove(3), 1);
+        EXPECT_EQ(b_tree.count(3), 3 - i);
+    }
+    EXPECT_EQ(b_tree.remove(3), 0);
+    EXPECT_EQ(b_tree.stats().hash_index_keys, 999);
+
+    b_tree.setLazyDeletion(true);
+    EXPECT_EQ(b_tree.remove(1), 1);
+    EXPECT_EQ(b_tree.search(1), b_tree.end());
+    EXPECT_EQ(b_tree.remove(1), 0);
+    b_tree.insert(1, 5);
+    EXPECT_EQ(b_tree.search(1)->value, 5);
+
+    auto copy = b_tree;
+    auto [left, right] = copy.splitAt(700);
+    EXPECT_EQ(left.search(701), left.end());
+    EXPECT_EQ(right.search(701)->key, 701);
+    EXPECT_EQ(left.stats().hash_index_keys + right.stats().hash_index_keys,
+              b_tree.size());
+
+    b_tree.setHashIndex(false);
+    EXPECT_EQ(b_tree.stats().hash_index_keys, 0);
+    EXPECT_EQ(b_tree.search(1499)->key, 1499);
+
+    // inserts in front of an indexed entry shift it within its node
+    BTree<int, int> shifted(3);
+    shifted.setHashIndex(true);
+    for (int i = 100; i >= 0; i--) {
+        shifted.insert(i, i);
+        EXPECT_EQ(*shifted.lookup(100), 100);
+        int middle = (i + 100) / 2;
+        EXPECT_EQ(shifted.search(middle)->key, middle);
+    }
+    for (int i = 0; i <= 100; i += 3) {
+        EXPECT_EQ(shifted.remove(i), 1);
+        EXPECT_EQ(shifted.lookup(i), nullptr);
+        EXPECT_EQ(*shifted.lookup(i + 1), i + 1);
+    }
+    EXPECT_EQ(shifted.stats().hash_index_keys, shifted.size());
+}
+
+TEST(BTreeTests, RepackTest) {
+    BTree<int, int, SumAggregate<int>> b_tree(4);
+    for (int i = 0; i < 5000; i++) {
+        b_tree.insert((i * 13) % 5000, 1);
+    }
+    b_tree.setOrderStatistics(true);
+    for (int i = 0; i < 5000; i += 3) {
+        b_tree.remove(i);
+    }
+    double churned_fill = b_tree.stats().fill_factor;
+
+    b_tree.repack();
+    EXPECT_GT(b_tree.stats().fill_factor, 0.9);
+    EXPECT_GT(b_tree.stats().fill_factor, churned_fill);
+    EXPECT_EQ(b_tree.size(), 3333);
+    EXPECT_EQ(b_tree.reduce(), 3333);
+    EXPECT_EQ(b_tree.select(0)->key, 1);
+    EXPECT_EQ(b_tree.rank(4999), 3332);
+
+    b_tree.repack(0.7);
+    EXPECT_NEAR(b_tree.stats().fill_factor, 0.7, 0.1);
+    b_tree.repack(0);
+    EXPECT_GT(b_tree.stats().fill_factor, 0.4);
+
+    int expected = 1;
+    for (auto e : b_tree) {
+        EXPECT_EQ(expected, e.key);
+        expected += expected % 3 == 1 ? 1 : 2;
+    }
+    EXPECT_EQ(expected, 5000);
+
+    for (int i = 0; i < 5000; i += 3) {
+        b_tree.insert(i, 1);
+    }
+    EXPECT_EQ(b_tree.size(), 5000);
+    EXPECT_EQ(b_tree.reduce(), 5000);
+}
+
+TEST(BTreeTests, FlatTopLevelsTest) {
+    BTree<int, int> b_tree(3);
+    b_tree.setFlatTopLevels(4096);
+    EXPECT_EQ(b_tree.search(1), b_tree.end());
+    for (int i = 0; i < 2000; i++) {
+        b_tree.insert((i * 7) % 2000, i);
+        EXPECT_EQ(b_tree.search((i * 7) % 2000)->key, (i * 7) % 2000);
+    }
+    for (int i = 0; i < 2000; i++) {
+        EXPECT_EQ(b_tree.search(i)->key, i);
+    }
+    EXPECT_EQ(b_tree.search(2000), b_tree.end());
+
+    for (int i = 0; i < 2000; i += 2) {
+        b_tree.remove(i);
+        EXPECT_EQ(b_tree.search(i), b_tree.end());
+    }
+    for (int i = 1; i < 2000; i += 2) {
+        EXPECT_EQ(b_tree.search(i)->key, i);
+    }
+
+    auto copy = b_tree;
+    size_t without_image = copy.memoryUsage();
+    EXPECT_EQ(copy.search(1)->key, 1);
+    EXPECT_GT(copy.memoryUsage(), without_image);
+    EXPECT_LE(copy.memoryUsage(), without_image + 4096);
+    b_tree.setFlatTopLevels(0);
+    for (int i = 0; i < 2000; i++) {
+        EXPECT_EQ(copy.search(i) != copy.end(), i % 2 == 1);
+        EXPECT_EQ(b_tree.search(i) != b_tree.end(), i % 2 == 1);
+    }
+    EXPECT_THROW(b_tree.setFlatTopLevels(-1), std::invalid_argument);
+
+    // nodes of several lines, and keys equal to the padding of the lines
+    BTree<int, int> wide(20);
+    wide.setFlatTopLevels(1 << 18);
+    for (int i = 0; i < 5000; i++) {
+        wide.insert(i * 3, i);
+    }
+    wide.insert(std::numeric_limits<int>::max(), 1);
+    wide.insert(std::numeric_limits<int>::min(), 2);
+    for (int i = -1; i < 15010; i++) {
+        EXPECT_EQ(wide.search(i) != wide.end(), i % 3 == 0 && i < 15000);
+    }
+    EXPECT_EQ(wide.search(std::numeric_limits<int>::max())->value, 1);
+    EXPECT_EQ(wide.search(std::numeric_limits<int>::min())->value, 2);
+}
+
+TEST(BTreeTests, NormalizedKeyTest) {
+    using Key = std::tuple<std::string, int, double>;
+    std::vector<Key> keys = {
+        {"", -5, 0.5}, {"a", 3, -1.5}, {"a", 3, -0.0}, {"a", 3, 0.0},
+        {"a", -3, 2.0}, {std::string("a\0b", 3), 0, 1.0}, {"ab", 0, 1.0},
+        {"b", std::numeric_limits<int>::min(), -1e300},
+        {"b", std::numeric_limits<int>::max(), 1e-300},
+    };
+    for (const auto &a : keys) {
+        EXPECT_EQ(NormalizedKey<Key>(a).key(), a);
+        for (const auto &b : keys) {
+            EXPECT_EQ(NormalizedKey<Key>(a) < NormalizedKey<Key>(b), a < b);
+            EXPECT_EQ(NormalizedKey<Key>(a) == NormalizedKey<Key>(b), a == b);
+        }
+    }
+
+    BTree<NormalizedKey<Key>, int> b_tree(3);
+    for (int i = 0; i < 500; i++) {
+        b_tree.insert(Key(std::to_string(i % 50), 250 - i, i * 0.5), i);
+    }
+    b_tree.setHashIndex(true);
+    EXPECT_EQ(b_tree.search(Key("7", 243, 3.5))->value, 7);
+    EXPECT_EQ(b_tree.search(Key("7", 243, 4.0)), b_tree.end());
+
+    Key previous = b_tree.begin()->key.key();
+    for (const auto &e : b_tree) {
+        EXPECT_FALSE(e.key.key() < previous);
+        previous = e.key.key();
+    }
+    EXPECT_EQ(b_tree.size(), 500);
+}
+
+struct ManualClock {
+    using duration = std::chrono::milliseconds;
+    using rep = duration::rep;
+    using period = duration::period;
+    using time_point = std::chrono::time_point<ManualClock>;
+    static constexpr bool is_steady = true;
+
+    static inline long milliseconds = 0;
+
+    static time_point now() {
+        return time_point(duration(milliseconds));
+    }
+};
+
+TEST(BTreeTests, MemoryAccountingTest) {
+    BTree<int, int> b_tree(3);
+    for (int i = 0; i < 1000; i++) {
+        b_tree.insert(i, i);
+    }
+    size_t walked = b_tree.memoryUsage();
+    EXPECT_GT(walked, 2000 * sizeof(int));
+
+    // the sums kept by the nodes include their Extras
+    b_tree.setMemoryAccounting(true);
+    EXPECT_GT(b_tree.memoryUsage(), walked);
+    for (int i = 0; i < 1000; i += 2) {
+        b_tree.remove(i);
+    }
+    for (int i = 1000; i < 1500; i++) {
+        b_tree.insert(i, i);
+    }
+    size_t accounted = b_tree.memoryUsage();
+    b_tree.setMemoryAccounting(false);
+    EXPECT_LT(b_tree.memoryUsage(), accounted);
+    b_tree.setMemoryAccounting(true);
+    EXPECT_EQ(b_tree.memoryUsage(), accounted);
+}
+
+TEST(BTreeTests, CacheTest) {
+    using namespace std::chrono_literals;
+    ManualClock::milliseconds = 0;
+
+    BTreeCache<int, int, ManualClock> cache(3, {.max_entries = 100});
+    for (int i = 0; i < 50; i++) {
+        cache.put(i, i, 10ms);
+    }
+    for (int i = 50; i < 100; i++) {
+        cache.put(i, i);
+    }
+    EXPECT_EQ(*cache.get(7), 7);
+
+    ManualClock::milliseconds = 10;
+    EXPECT_EQ(cache.get(8), nullptr);
+    EXPECT_EQ(*cache.get(50), 50);
+    int visited = 0;
+    cache.scan(0, 60, [&visited](int key, int value) {
+        EXPECT_EQ(key, value);
+        EXPECT_GE(key, 50);
+        visited++;
+    });
+    EXPECT_EQ(visited, 10);
+
+    // every write removes a couple of expired entries
+    for (int i = 0; i < 10; i++) {
+        cache.put(1000 + i, i);
+    }
+    EXPECT_EQ(cache.size(), 89);
+    EXPECT_EQ(cache.expire(100), 29);
+    EXPECT_EQ(cache.expirations(), 50);
+    EXPECT_EQ(cache.size(), 60);
+
+    // least recently used entries are evicted past max_entries,
+    // 50 and 51 were read after 52 and 53 were written
+    for (int i = 0; i < 40; i++) {
+        cache.put(2000 + i, i);
+    }
+    EXPECT_EQ(*cache.get(51), 51);
+    cache.put(3000, 0);
+    cache.put(3001, 0);
+    EXPECT_EQ(cache.size(), 100);
+    EXPECT_EQ(cache.evictions(), 2);
+    EXPECT_EQ(cache.get(52), nullptr);
+    EXPECT_EQ(cache.get(53), nullptr);
+    EXPECT_EQ(*cache.get(50), 50);
+    EXPECT_EQ(*cache.get(51), 51);
+    EXPECT_EQ(cache.erase(51), 1);
+    EXPECT_EQ(cache.erase(51), 0);
+
+    // a replaced value is moved into the stored slot
+    BTreeCache<int, std::string, ManualClock> names(3);
+    names.put(1, "a");
+    names.put(1, "b", 10ms);
+    EXPECT_EQ(*names.get(1), "b");
+    EXPECT_EQ(names.size(), 1);
+
+    BTreeCache<int, int, ManualClock> bounded(
+        3, {.max_bytes = 16384, .policy = EvictionPolicy::kSmallestKey});
+    for (int i = 0; i < 10000; i++) {
+        bounded.put(i, i);
+        EXPECT_LE(bounded.memoryUsage(), 16384);
+    }
+    EXPECT_EQ(*bounded.get(9999), 9999);
+    EXPECT_EQ(bounded.get(0), nullptr);
+    EXPECT_EQ(bounded.evictions(), 10000 - bounded.size());
+}
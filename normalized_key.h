@@ -0,0 +1,240 @@
+#ifndef B_TREE__NORMALIZED_KEY_H_
+#define B_TREE__NORMALIZED_KEY_H_
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <compare>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+/*
+ * customization point that writes a key as bytes whose memcmp order is
+ * the order of the keys: encode appends the bytes of key to out,
+ * decode reads them back from in and advances it past them;
+ * specializations are provided for integers, floats, strings,
+ * std::chrono durations and time points, pairs and tuples of these
+*/
+template<typename T>
+struct KeyNormalizer;
+
+template<typename T>
+concept NormalizableKey = requires(const T &key, std::string &out,
+                                   const char *&in) {
+    KeyNormalizer<T>::encode(key, out);
+    { KeyNormalizer<T>::decode(in) } -> std::same_as<T>;
+};
+
+/*
+ * big-endian bytes of the value as unsigned, the sign bit of signed
+ * integers is flipped so negative values come first
+*/
+template<std::integral T>
+struct KeyNormalizer<T> {
+    static void encode(const T &key, std::string &out) {
+        if constexpr (std::is_same_v<T, bool>) {
+            out.push_back(static_cast<char>(key));
+        } else {
+            using Unsigned = std::make_unsigned_t<T>;
+            auto bits = static_cast<Unsigned>(key);
+            if constexpr (std::is_signed_v<T>) {
+                bits ^= Unsigned(1) << (sizeof(T) * 8 - 1);
+            }
+            for (long shift = (sizeof(T) - 1) * 8; shift >= 0; shift -= 8) {
+                out.push_back(static_cast<char>(bits >> shift));
+            }
+        }
+    }
+
+    static T decode(const char *&in) {
+        if constexpr (std::is_same_v<T, bool>) {
+            return *in++ != 0;
+        } else {
+            using Unsigned = std::make_unsigned_t<T>;
+            Unsigned bits = 0;
+            for (size_t i = 0; i < sizeof(T); ++i) {
+                bits = static_cast<Unsigned>(
+                    (bits << 8) | static_cast<unsigned char>(*in++));
+            }
+            if constexpr (std::is_signed_v<T>) {
+                bits ^= Unsigned(1) << (sizeof(T) * 8 - 1);
+            }
+            return static_cast<T>(bits);
+        }
+    }
+};
+
+/*
+ * IEEE 754 bits with the sign bit flipped for positive values and all
+ * bits flipped for negative ones, -0.0 is written as 0.0;
+ * NaN keys are not ordered and must not be used
+*/
+template<std::floating_point T> requires std::numeric_limits<T>::is_iec559
+    && (sizeof(T) == sizeof(uint32_t) || sizeof(T) == sizeof(uint64_t))
+struct KeyNormalizer<T> {
+    using Bits = std::conditional_t<sizeof(T) == sizeof(uint32_t),
+                                    uint32_t, uint64_t>;
+    static constexpr Bits kSignBit = Bits(1) << (sizeof(T) * 8 - 1);
+
+    static void encode(const T &key, std::string &out) {
+        auto bits = std::bit_cast<Bits>(key == 0 ? T(0) : key);
+        bits = (bits & kSignBit) != 0 ? ~bits : bits | kSignBit;
+        KeyNormalizer<Bits>::encode(bits, out);
+    }
+
+    static T decode(const char *&in) {
+        Bits bits = KeyNormalizer<Bits>::decode(in);
+        bits = (bits & kSignBit) != 0 ? bits & ~kSignBit : ~bits;
+        return std::bit_cast<T>(bits);
+    }
+};
+
+/*
+ * the characters with 0 escaped as 0 0xff, followed by the terminator
+ * 0 1, so a string sorts before every string it is a prefix of and the
+ * next field of a tuple starts after a known boundary
+*/
+template<>
+struct KeyNormalizer<std::string> {
+    static void encode(const std::string &key, std::string &out) {
+        for (char c : key) {
+            out.push_back(c);
+            if (c == '\0') {
+                out.push_back('\xff');
+            }
+        }
+        out.push_back('\0');
+        out.push_back('\x01');
+    }
+
+    static std::string decode(const char *&in) {
+        std::string key;
+        while (in[0] != '\0' || in[1] != '\x01') {
+            key.push_back(*in);
+            in += in[0] == '\0' ? 2 : 1;
+        }
+        in += 2;
+        return key;
+    }
+};
+
+template<typename Rep, typename Period>
+    requires NormalizableKey<Rep>
+struct KeyNormalizer<std::chrono::duration<Rep, Period>> {
+    using Duration = std::chrono::duration<Rep, Period>;
+
+    static void encode(const Duration &key, std::string &out) {
+        KeyNormalizer<Rep>::encode(key.count(), out);
+    }
+
+    static Duration decode(const char *&in) {
+        return Duration(KeyNormalizer<Rep>::decode(in));
+    }
+};
+
+template<typename Clock, typename Duration>
+    requires NormalizableKey<Duration>
+struct KeyNormalizer<std::chrono::time_point<Clock, Duration>> {
+    using TimePoint = std::chrono::time_point<Clock, Duration>;
+
+    static void encode(const TimePoint &key, std::string &out) {
+        KeyNormalizer<Duration>::encode(key.time_since_epoch(), out);
+    }
+
+    static TimePoint decode(const char *&in) {
+        return TimePoint(KeyNormalizer<Duration>::decode(in));
+    }
+};
+
+/*
+ * the fields one after another, which gives the lexicographic order
+ * of std::tuple as long as every field encodes to a prefix-free code
+*/
+template<typename... Ts> requires (NormalizableKey<Ts> && ...)
+struct KeyNormalizer<std::tuple<Ts...>> {
+    static void encode(const std::tuple<Ts...> &key, std::string &out) {
+        std::apply([&out](const Ts &... fields) {
+            (KeyNormalizer<Ts>::encode(fields, out), ...);
+        }, key);
+    }
+
+    static std::tuple<Ts...> decode(const char *&in) {
+        // a braced list evaluates its elements in order
+        return std::tuple<Ts...>{KeyNormalizer<Ts>::decode(in)...};
+    }
+};
+
+template<typename T1, typename T2>
+    requires NormalizableKey<T1> && NormalizableKey<T2>
+struct KeyNormalizer<std::pair<T1, T2>> {
+    static void encode(const std::pair<T1, T2> &key, std::string &out) {
+        KeyNormalizer<T1>::encode(key.first, out);
+        KeyNormalizer<T2>::encode(key.second, out);
+    }
+
+    static std::pair<T1, T2> decode(const char *&in) {
+        T1 first = KeyNormalizer<T1>::decode(in);
+        T2 second = KeyNormalizer<T2>::decode(in);
+        return {std::move(first), std::move(second)};
+    }
+};
+
+/*
+ * a key stored as its normalized bytes, so BTree<NormalizedKey<T>, V>
+ * orders entries like T but every comparison is a single memcmp
+ * instead of a chain of field comparisons;
+ * converts implicitly from T, key() decodes the original key
+*/
+template<NormalizableKey T>
+class NormalizedKey {
+  public:
+    NormalizedKey() = default;
+
+    NormalizedKey(const T &key) {
+        KeyNormalizer<T>::encode(key, bytes_);
+    }
+
+    [[nodiscard]] T key() const {
+        const char *in = bytes_.data();
+        return KeyNormalizer<T>::decode(in);
+    }
+
+    [[nodiscard]] const std::string &bytes() const {
+        return bytes_;
+    }
+
+    friend bool operator==(const NormalizedKey &a, const NormalizedKey &b) {
+        return a.bytes_ == b.bytes_;
+    }
+
+    friend std::strong_ordering operator<=>(const NormalizedKey &a,
+                                            const NormalizedKey &b) {
+        size_t common = std::min(a.bytes_.size(), b.bytes_.size());
+        int order = std::memcmp(a.bytes_.data(), b.bytes_.data(), common);
+        if (order != 0) {
+            return order <=> 0;
+        }
+        return a.bytes_.size() <=> b.bytes_.size();
+    }
+
+  private:
+    std::string bytes_;
+};
+
+template<typename T>
+struct std::hash<NormalizedKey<T>> {
+    size_t operator()(const NormalizedKey<T> &key) const {
+        return std::hash<std::string_view>{}(key.bytes());
+    }
+};
+
+#endif